@@ -17,6 +17,8 @@
  */
 
 
+#define _GNU_SOURCE /* copy_file_range */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,7 +26,20 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <aio.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <time.h>
+#include <zlib.h>
 
 
 #ifdef __linux__
@@ -53,6 +68,7 @@
 
 #include "version.h"
 #include "bootimg.h"
+#include "sha1.h"
 
 
 enum command {
@@ -62,10 +78,66 @@ enum command {
   extract,
   update,
   create,
-  dtbs
+  createfarm,
+  dtbs,
+  batch,
+  verify,
+  dtbmatch,
+  bench,
+  packarchive,
+  unpackarchive,
+  serve,
+  ramdiskls
 };
 
 
+#define MAX_CONF_LEN    4096
+#define MAX_RAMDISK_PARTS 16
+#define DTBH_MAGIC      0x48425444  /* "DTBH" */
+
+
+/* image layout, computed once per header by compute_layout() instead
+ * of re-derived (inconsistently) at every use site.  every section
+ * offset is the previous offset plus the previous size rounded up to a
+ * page; the rounding is a shift for power-of-two page sizes, which is
+ * every page size seen in the fleet (2048/4096/16384). */
+typedef struct
+{
+  unsigned page_size;
+  unsigned shift;          /* log2(page_size), 0 when not a power of two */
+  unsigned kernel_offset;
+  unsigned ramdisk_offset;
+  unsigned second_offset;
+  unsigned dtbs_offset;
+  unsigned sig_offset;     /* signature page; also the payload size */
+  unsigned total_size;     /* payload plus the signature page */
+} t_layout;
+
+
+/* sidecar index (ABOOTIMG_SIDECAR=1): one <image>.abidx record holding
+ * the validated header, the layout and the section digests, keyed to
+ * the image's size and mtime and sealed with its own sha1.  while the
+ * key still matches, repeat operations take the header and layout from
+ * the sidecar and a repeat verify costs a stat plus one small read
+ * instead of re-reading and re-hashing the image -- which is what
+ * dominates fleet verification runs over NFS.  a torn, stale or
+ * foreign sidecar fails its checks and is simply ignored. */
+
+#define SIDECAR_MAGIC "ABIDX01!"
+
+typedef struct
+{
+  char          magic[8];
+  unsigned      src_size;
+  long long     src_mtime;
+  long long     src_mtime_nsec;
+  boot_img_hdr  header;
+  t_layout      layout;
+  unsigned char sha1[4][SHA1_DIGEST_SIZE]; /* kernel/ramdisk/second/dtbs */
+  unsigned char self[SHA1_DIGEST_SIZE];    /* digest of everything above */
+} t_sidecar;
+
+
 typedef struct
 {
   unsigned     size;
@@ -79,9 +151,42 @@ typedef struct
   char*        dtbs_fname;
   char*        signature_fname;
 
+  /* -r given several times: the ramdisk is the concatenation of these
+   * parts, gathered back-to-back at write time (overlay builds) */
+  char*        ramdisk_parts[MAX_RAMDISK_PARTS];
+  int          ramdisk_nparts;
+  char**       ramdisk_part_data; /* loaded parts, NULL entries are streamed */
+  unsigned*    ramdisk_part_size;
+
+  char*        dtb_match;  /* --dtb-match selector (chip_id=...,hw_rev=...) */
+  char*        ramdisk_dir; /* --repack-ramdisk source directory */
+  int          flash_delta; /* --flash-delta: write only pages that differ */
+  int          flash_resume; /* --resume: skip sections already on the target */
+
+  /* --bench parameters: synthesized image size, page size, dtb count */
+  unsigned     bench_size;
+  unsigned     bench_psize;
+  unsigned     bench_ndtbs;
+
+  /* --pack-archive/--unpack-archive trailing arguments */
+  char**       archive_args;
+  int          archive_argc;
+  char*        info_format; /* -i --format=json|tsv, NULL for human text */
+
   FILE*        stream;
 
+  char*        map;       /* read-only mapping of the image, NULL if unavailable */
+  unsigned     map_size;
+
   boot_img_hdr header;
+  t_layout     layout;    /* section offsets derived from header */
+
+  t_sidecar    sidecar;    /* loaded index, only valid when sidecar_ok */
+  int          sidecar_ok;
+
+  boot_img_hdr orig_header; /* header as found on disk, for dirty tracking */
+  int          has_orig;
+  int          dirty_signature;
 
   char*        kernel;
   char*        ramdisk;
@@ -89,13 +194,43 @@ typedef struct
   void*        dtbh;
   void**       dtbs;
 
+  /* dtb cache state: an entry proven unchanged either already sits at
+   * its final offset (clean) or is copied within the image (from) */
+  unsigned*    dtb_from;
+  int*         dtb_clean;
+
+  /* cache entries staged by update_images, persisted only once the
+   * writer is done: a cache saved before the flash would key offsets
+   * the image never received to still-matching source files */
+  struct s_dtb_cache* dtb_cache_pending;
+  int                 dtb_cache_npending;
+
+  /* streaming mode (-S): payload files are piped through a bounded
+   * buffer instead of being loaded whole; *_src names the source file */
+  unsigned     stream_bufsz;
+  char*        kernel_src;
+  char*        ramdisk_src;
+  char*        second_src;
+
+  /* lazy extents: source offset of a payload that only moves inside
+   * the image; write_bootimg relocates it without materializing it
+   * (0 = not lazy, offset 0 always holds the header) */
+  unsigned     kernel_from;
+  unsigned     ramdisk_from;
+  unsigned     second_from;
+  unsigned     dtbs_from;
+
   char signature[255];
 
-} t_abootimg;
+  char config_args[MAX_CONF_LEN];
 
+  /* arena: per-image section buffers are carved out of a few big
+   * anonymous mappings and released together, instead of one malloc
+   * per section/dtb */
+  struct s_arena_block* arena;
+  pthread_mutex_t       arena_lock;
 
-#define MAX_CONF_LEN    4096
-char config_args[MAX_CONF_LEN] = "";
+} t_abootimg;
 
 
 
@@ -116,6 +251,95 @@ void abort_printf(char *fmt, ...)
 }
 
 
+// pages needed to hold size bytes
+unsigned layout_pages(t_layout* l, unsigned size)
+{
+  if (l->shift)
+    return (size + l->page_size - 1) >> l->shift;
+  return (size + l->page_size - 1) / l->page_size;
+}
+
+
+// round size up to a whole number of pages
+unsigned layout_roundup(t_layout* l, unsigned size)
+{
+  return layout_pages(l, size) * l->page_size;
+}
+
+
+void compute_layout(boot_img_hdr* h, t_layout* l)
+{
+  l->page_size = h->page_size;
+  l->shift = (h->page_size & (h->page_size - 1))
+             ? 0 : (unsigned)__builtin_ctz(h->page_size);
+
+  l->kernel_offset  = h->page_size;
+  l->ramdisk_offset = l->kernel_offset  + layout_roundup(l, h->kernel_size);
+  l->second_offset  = l->ramdisk_offset + layout_roundup(l, h->ramdisk_size);
+  l->dtbs_offset    = l->second_offset  + layout_roundup(l, h->second_size);
+  l->sig_offset     = l->dtbs_offset    + layout_roundup(l, h->dtbs_size);
+  l->total_size     = l->sig_offset + h->page_size;
+}
+
+
+#define ARENA_CHUNK (4*1024*1024)
+
+typedef struct s_arena_block
+{
+  struct s_arena_block* next;
+  unsigned              size;   /* usable bytes after this header */
+  unsigned              used;
+} t_arena_block;
+
+
+// add a mapping to the arena, sized for at least size bytes
+void arena_reserve(t_abootimg* img, unsigned size)
+{
+  unsigned total = size + sizeof(t_arena_block);
+  if (total < ARENA_CHUNK)
+    total = ARENA_CHUNK;
+  total = (total + 4095) & ~4095u;
+
+  t_arena_block* block = mmap(NULL, total, PROT_READ|PROT_WRITE,
+                              MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED)
+    abort_perror(NULL);
+
+  block->next = img->arena;
+  block->size = total - sizeof(t_arena_block);
+  block->used = 0;
+  img->arena = block;
+}
+
+
+void* arena_alloc(t_abootimg* img, unsigned size)
+{
+  size = (size + 15) & ~15u;
+
+  pthread_mutex_lock(&img->arena_lock);
+  if (!img->arena || (img->arena->size - img->arena->used < size))
+    arena_reserve(img, size);
+
+  char* p = (char*)(img->arena + 1) + img->arena->used;
+  img->arena->used += size;
+  pthread_mutex_unlock(&img->arena_lock);
+
+  return p;
+}
+
+
+void arena_release(t_abootimg* img)
+{
+  t_arena_block* block = img->arena;
+  while (block) {
+    t_arena_block* next = block->next;
+    munmap(block, block->size + sizeof(t_arena_block));
+    block = next;
+  }
+  img->arena = NULL;
+}
+
+
 int blkgetsize(int fd, unsigned long long *pbsize)
 {
 # if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -137,6 +361,51 @@ int blkgetsize(int fd, unsigned long long *pbsize)
 
 }
 
+// parse a size argument like "4194304", "512K" or "4M"
+unsigned parse_size(char* str)
+{
+  char* end = NULL;
+  unsigned long size = strtoul(str, &end, 0);
+
+  switch (*end) {
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
+  }
+  if ((end == str) || *end || !size)
+    abort_printf("%s: bad size", str);
+
+  return size;
+}
+
+
+// lightweight runtime profiling: with ABOOTIMG_PROF set, the hot
+// phases (read_header, update_images, write_bootimg) report their wall
+// time on stderr, cheap enough to leave on in CI
+
+double prof_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+// returns the start timestamp, or 0.0 when profiling is off
+double prof_begin(void)
+{
+  static int on = -1;
+  if (on < 0)
+    on = (getenv("ABOOTIMG_PROF") != NULL);
+  return on ? prof_now() : 0.0;
+}
+
+void prof_end(char* phase, double t0)
+{
+  if (t0 != 0.0)
+    fprintf(stderr, "prof: %-14s %8.3f ms\n", phase, prof_now() - t0);
+}
+
+
 void print_usage(void)
 {
   printf (
@@ -148,9 +417,10 @@ void print_usage(void)
  "\n"
  "      print usage\n"
  "\n"
- " abootimg -i <bootimg>\n"
+ " abootimg -i <bootimg> [--format=json|tsv]\n"
  "\n"
- "      print boot image information\n"
+ "      print boot image information; --format emits all header fields\n"
+ "      and layout offsets machine-readable in a single write\n"
  "\n"
  " abootimg -x <bootimg> [<bootimg.cfg> [<kernel> [<ramdisk> [<secondstage>[<devicetrees>]]]]]\n"
  "\n"
@@ -162,7 +432,7 @@ void print_usage(void)
  "      - device trees (default name platform[.dtbh|.dtb_p#])\n"
  "      - signature (default name signature )\n"
  "\n"
- " abootimg -u <bootimg> [-c \"param=value\"] [-f <bootimg.cfg>] [-k <kernel>] [-r <ramdisk>] [-s <secondstage>] [-d <dtbs>] [-g <signature>]\n"
+ " abootimg -u <bootimg> [-c \"param=value\"] [-f <bootimg.cfg>] [-k <kernel>] [-r <ramdisk>] [-s <secondstage>] [-d <dtbs>] [-g <signature>] [-S <bufsize>]\n"
  "\n"
  "      update a current boot image with objects given in command line\n"
  "      - header informations given in arguments (several can be provided)\n"
@@ -172,6 +442,28 @@ void print_usage(void)
  "      - second stage image\n"
  "      - dtbs\n"
  "\n"
+ "      with --repack-ramdisk <dir>, the ramdisk is rebuilt in-process\n"
+ "      from the given directory tree (newc cpio + block-parallel gzip,\n"
+ "      no temp files, all cores), replacing the pack-initrd script.\n"
+ "\n"
+ "      -r can be given several times: the ramdisk is then the\n"
+ "      concatenation of the parts (base + overlays), gathered straight\n"
+ "      into the image without building a combined file first.\n"
+ "\n"
+ "      with -S, kernel/ramdisk/second files are streamed through a buffer\n"
+ "      of the given size (e.g. -S 4M) instead of being loaded in memory,\n"
+ "      keeping peak memory bounded whatever the image size.\n"
+ "\n"
+ "      with --flash-delta, the target is compared page by page against\n"
+ "      what it already holds and only the differing pages are written;\n"
+ "      near-instant when reflashing a partition holding a previous build.\n"
+ "\n"
+ "      with --resume, each section's checksum is compared against what the\n"
+ "      target already holds and sections that landed in full are skipped,\n"
+ "      so an interrupted flash resumes instead of rewriting everything.\n"
+ "      the header goes last either way: a torn flash never presents a\n"
+ "      valid magic to the bootloader.\n"
+ "\n"
  "      bootimg has to be valid Android Boot Image, or the update will abort.\n"
  "\n"
  " abootimg --create <bootimg> [-c \"param=value\"] [-f <bootimg.cfg>] -k <kernel> -r <ramdisk> [-s <secondstage>] [-d <dtbs>] [-g <signature>]\n"
@@ -183,9 +475,84 @@ void print_usage(void)
  "      argurments are the same than for -u.\n"
  "      kernel and ramdisk are mandatory.\n"
  "\n"
+ " abootimg --create-farm <variants.txt> -k <kernel> -r <ramdisk> [-s <secondstage>] [-d <dtbs>] [-f <bootimg.cfg>] [-c \"param=value\"]\n"
+ "\n"
+ "      create many variant images from one set of payloads. the\n"
+ "      kernel/ramdisk/second are loaded once and shared read-only by\n"
+ "      parallel writers, so a 40-variant nightly run reads them once\n"
+ "      instead of 40 times. each line of the variants file names an\n"
+ "      output image followed by its overrides, ';' separated:\n"
+ "          boot-eu.img  cmdline = console=ttyS0; name = eu\n"
+ "          boot-us.img  dtb1 = us-board.dtb\n"
+ "      \"dtb<N> = <file>\" swaps entry N of the device tree table for\n"
+ "      that variant; the other entries keep the shared blobs.\n"
+ "\n"
  " abootimg --dtbs <platform.dbts>\n"
  "\n"
  "      print device tree header information\n"
+ "\n"
+ " abootimg --dtb-match <bootimg> <key=value[,key=value...]> [<out.dtb>]\n"
+ "\n"
+ "      extract the one dtb matching the device (keys: chip_id,\n"
+ "      platform_id, subtype_id, hw_rev), reading only the dtbh entry\n"
+ "      table plus that dtb instead of the whole dtbs blob.\n"
+ "      default output name is matched.dtb.\n"
+ "\n"
+ " abootimg --verify <bootimg>\n"
+ "\n"
+ "      checksum the image sections (in parallel across cores) and check\n"
+ "      the mkbootimg sha1 stored in the header id[] field.\n"
+ "\n"
+ "      with ABOOTIMG_SIDECAR=1 in the environment, a successful verify\n"
+ "      records the header, layout and digests in <bootimg>.abidx keyed\n"
+ "      to the image's size and mtime; while those still match, repeat\n"
+ "      operations take the header from the sidecar and a repeat verify\n"
+ "      is a stat plus one small read instead of rehashing the image.\n"
+ "\n"
+ " abootimg --batch <jobs.txt>\n"
+ "\n"
+ "      run many jobs from a file over a pool of worker threads.\n"
+ "      each line holds the arguments of one invocation, e.g.:\n"
+ "          -i boot1.img\n"
+ "          -u boot2.img -c \"cmdline = console=ttyS0\"\n"
+ "      empty lines and lines starting with # are skipped.\n"
+ "\n"
+ " abootimg --pack-archive <out.abar> <bootimg> [<bootimg> ...]\n"
+ "\n"
+ "      pack several boot images into one archive with a section-level\n"
+ "      content index: identical kernels/ramdisks/dtbs across device\n"
+ "      variants are stored once.\n"
+ "\n"
+ " abootimg --unpack-archive <archive.abar> [<name> [<out>]]\n"
+ "\n"
+ "      without a name, list the archived images. with one, rebuild\n"
+ "      that image (an index lookup plus ranged reads, only its bytes\n"
+ "      are touched); output name defaults to the archived name.\n"
+ "\n"
+ " abootimg --ramdisk-ls <bootimg>\n"
+ "\n"
+ "      list the ramdisk contents (like cpio -t) by streaming the\n"
+ "      section straight out of the image through an in-process inflate\n"
+ "      into a newc header scanner: no temp files, no child processes,\n"
+ "      decompress-only bandwidth.\n"
+ "\n"
+ " abootimg --serve <socket>\n"
+ "\n"
+ "      daemon mode for provisioning stations: listen on a unix socket\n"
+ "      and take one job line per connection (same syntax as --batch),\n"
+ "      streaming the job's output back. golden images named in the jobs\n"
+ "      are validated and mapped once in the daemon and stay warm, so\n"
+ "      each attached device pays an accept+fork instead of a full\n"
+ "      open+read+validate. send \"quit\" to shut the daemon down.\n"
+ "\n"
+ " abootimg --bench [<size> [<pagesize> [<ndtbs>]]]\n"
+ "\n"
+ "      synthesize a boot image (default 64M, 2048 byte pages, 8 dtbs)\n"
+ "      in a scratch directory under $TMPDIR and time the hot paths\n"
+ "      (create, info, extract, update, delta reflash), reporting wall\n"
+ "      time, block I/O and peak RSS per phase.\n"
+ "      set ABOOTIMG_PROF=1 in the environment to get per-phase wall\n"
+ "      times (read_header/update_images/write_bootimg) on any command.\n"
  "\n"
     );
 }
@@ -214,9 +581,36 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
   else if (!strcmp(argv[1], "--create")) {
     cmd=create;
   }
+  else if (!strcmp(argv[1], "--create-farm")) {
+    cmd = createfarm;
+  }
   else if (!strcmp(argv[1], "--dtbs")) {
     cmd=dtbs;
   }
+  else if (!strcmp(argv[1], "--batch")) {
+    cmd=batch;
+  }
+  else if (!strcmp(argv[1], "--verify")) {
+    cmd=verify;
+  }
+  else if (!strcmp(argv[1], "--bench")) {
+    cmd = bench;
+  }
+  else if (!strcmp(argv[1], "--pack-archive")) {
+    cmd = packarchive;
+  }
+  else if (!strcmp(argv[1], "--unpack-archive")) {
+    cmd = unpackarchive;
+  }
+  else if (!strcmp(argv[1], "--dtb-match")) {
+    cmd=dtbmatch;
+  }
+  else if (!strcmp(argv[1], "--serve")) {
+    cmd = serve;
+  }
+  else if (!strcmp(argv[1], "--ramdisk-ls")) {
+    cmd = ramdiskls;
+  }
   else
     return none;
 
@@ -226,11 +620,18 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
 	    break;
 
     case info:
-      if (argc != 3)
+      if ((argc < 3) || (argc > 4))
+        return none;
+      for (i=2; i<argc; i++) {
+        if (!strncmp(argv[i], "--format=", 9))
+          img->info_format = argv[i]+9;
+        else
+          img->fname = argv[i];
+      }
+      if (!img->fname)
         return none;
-      img->fname = argv[2];
       break;
-      
+
     case extract:
       if ((argc < 3) || (argc > 7))
         return none;
@@ -251,6 +652,7 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
 
     case update:
     case create:
+    case createfarm:
       if (argc < 3)
         return none;
       img->fname = argv[2];
@@ -266,10 +668,10 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
           if (++i >= argc)
             return none;
           unsigned len = strlen(argv[i]);
-          if (strlen(config_args)+len+1 >= MAX_CONF_LEN)
+          if (strlen(img->config_args)+len+1 >= MAX_CONF_LEN)
             abort_printf("too many config parameters.\n");
-          strcat(config_args, argv[i]);
-          strcat(config_args, "\n");
+          strcat(img->config_args, argv[i]);
+          strcat(img->config_args, "\n");
         }
         else if (!strcmp(argv[i], "-f")) {
           if (++i >= argc)
@@ -284,7 +686,10 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
         else if (!strcmp(argv[i], "-r")) {
           if (++i >= argc)
             return none;
-          img->ramdisk_fname = argv[i];
+          if (img->ramdisk_nparts == MAX_RAMDISK_PARTS)
+            abort_printf("too many -r parts (max %d)\n", MAX_RAMDISK_PARTS);
+          img->ramdisk_parts[img->ramdisk_nparts++] = argv[i];
+          img->ramdisk_fname = img->ramdisk_parts[0];
         }
         else if (!strcmp(argv[i], "-s")) {
           if (++i >= argc)
@@ -301,17 +706,69 @@ enum command parse_args(int argc, char** argv, t_abootimg* img)
             return none;
           img->signature_fname = argv[i];
         }
+        else if (!strcmp(argv[i], "-S")) {
+          if (++i >= argc)
+            return none;
+          img->stream_bufsz = parse_size(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--repack-ramdisk")) {
+          if (++i >= argc)
+            return none;
+          img->ramdisk_dir = argv[i];
+        }
+        else if (!strcmp(argv[i], "--flash-delta")) {
+          img->flash_delta = 1;
+        }
+        else if (!strcmp(argv[i], "--resume")) {
+          img->flash_resume = 1;
+        }
         else
           return none;
       }
       break;
     case dtbs:
+    case batch:
+    case verify:
+    case serve:
+    case ramdiskls:
       if (argc != 3)
         return none;
       img->fname = argv[2];
       break;
+
+    case dtbmatch:
+      if ((argc < 4) || (argc > 5))
+        return none;
+      img->fname = argv[2];
+      img->dtb_match = argv[3];
+      img->dtbs_fname = (argc == 5) ? argv[4] : "matched.dtb";
+      break;
+
+    case bench:
+      if (argc > 5)
+        return none;
+      img->bench_size = (argc > 2) ? parse_size(argv[2]) : 64*1024*1024;
+      img->bench_psize = (argc > 3) ? parse_size(argv[3]) : 2048;
+      img->bench_ndtbs = (argc > 4) ? parse_size(argv[4]) : 8;
+      break;
+
+    case packarchive:
+      if (argc < 4)
+        return none;
+      img->fname = argv[2];
+      img->archive_args = &argv[3];
+      img->archive_argc = argc - 3;
+      break;
+
+    case unpackarchive:
+      if ((argc < 3) || (argc > 5))
+        return none;
+      img->fname = argv[2];
+      img->archive_args = &argv[3];
+      img->archive_argc = argc - 3;
+      break;
   }
-  
+
   return cmd;
 }
 
@@ -342,15 +799,10 @@ int check_boot_img_header(t_abootimg* img)
 
   // warning, page size is not of valid size?
 
-  unsigned n = (img->header.kernel_size + page_size - 1) / page_size;
-  unsigned m = (img->header.ramdisk_size + page_size - 1) / page_size;
-  unsigned o = (img->header.second_size + page_size - 1) / page_size;
-  unsigned p = (img->header.dtbs_size + page_size - 1) / page_size;
+  compute_layout(&img->header, &img->layout);
 
-  unsigned total_size = (1+n+m+o+p)*page_size;
-
-  if (total_size > img->size) {
-    fprintf(stderr, "%s: sizes mismatches\n  total_size %u != img size %u\n", img->fname, total_size, img->size);
+  if (img->layout.sig_offset > img->size) {
+    fprintf(stderr, "%s: sizes mismatches\n  total_size %u != img size %u\n", img->fname, img->layout.sig_offset, img->size);
     return 1;
   }
 
@@ -402,14 +854,86 @@ void open_bootimg(t_abootimg* img, char* mode)
 
 
 
-void read_header(t_abootimg* img)
+// load <image>.abidx and check it against the image: intact record,
+// matching size and mtime. returns 1 when the image provably has not
+// changed since it was validated
+int sidecar_load(t_abootimg* img, t_sidecar* sc)
 {
-  size_t rb = fread(&img->header, sizeof(boot_img_hdr), 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
-  else if (feof(img->stream))
-    abort_printf("%s: cannot read image header\n", img->fname);
+  if (!getenv("ABOOTIMG_SIDECAR") || img->is_blkdev)
+    return 0;
+
+  char fname[PATH_MAX];
+  snprintf(fname, sizeof(fname), "%s.abidx", img->fname);
+
+  FILE* f = fopen(fname, "r");
+  if (!f)
+    return 0;
+  size_t rb = fread(sc, sizeof(*sc), 1, f);
+  fclose(f);
+  if (rb != 1)
+    return 0;
+
+  if (memcmp(sc->magic, SIDECAR_MAGIC, 8))
+    return 0;
+
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  sha1_ctx ctx;
+  sha1_init(&ctx);
+  sha1_update(&ctx, sc, offsetof(t_sidecar, self));
+  sha1_final(&ctx, digest);
+  if (memcmp(digest, sc->self, SHA1_DIGEST_SIZE))
+    return 0;
+
+  struct stat st;
+  if (stat(img->fname, &st) || !S_ISREG(st.st_mode))
+    return 0;
+  if ((st.st_size != (off_t)sc->src_size)
+      || (st.st_mtim.tv_sec != sc->src_mtime)
+      || (st.st_mtim.tv_nsec != sc->src_mtime_nsec))
+    return 0;
+
+  return 1;
+}
+
+
+void sidecar_save(t_abootimg* img, unsigned char sha1[4][SHA1_DIGEST_SIZE])
+{
+  if (!getenv("ABOOTIMG_SIDECAR") || img->is_blkdev)
+    return;
+
+  struct stat st;
+  if (fstat(fileno(img->stream), &st) || !S_ISREG(st.st_mode))
+    return;
+
+  t_sidecar sc;
+  memset(&sc, 0, sizeof(sc));
+  memcpy(sc.magic, SIDECAR_MAGIC, 8);
+  sc.src_size = st.st_size;
+  sc.src_mtime = st.st_mtim.tv_sec;
+  sc.src_mtime_nsec = st.st_mtim.tv_nsec;
+  sc.header = img->header;
+  sc.layout = img->layout;
+  memcpy(sc.sha1, sha1, sizeof(sc.sha1));
+
+  sha1_ctx ctx;
+  sha1_init(&ctx);
+  sha1_update(&ctx, &sc, offsetof(t_sidecar, self));
+  sha1_final(&ctx, sc.self);
+
+  char fname[PATH_MAX];
+  snprintf(fname, sizeof(fname), "%s.abidx", img->fname);
+
+  FILE* f = fopen(fname, "w");
+  if (!f)
+    return; // the sidecar is an optimization, not worth aborting over
+  fwrite(&sc, sizeof(sc), 1, f);
+  fclose(f);
+}
+
 
+
+void read_header(t_abootimg* img)
+{
   struct stat s;
   int fd = fileno(img->stream);
   if (fstat(fd, &s))
@@ -428,83 +952,172 @@ void read_header(t_abootimg* img)
     img->is_blkdev = 0;
   }
 
-  if (check_boot_img_header(img))
-    abort_printf("%s: not a valid Android Boot Image.\n", img->fname);
+  if (sidecar_load(img, &img->sidecar)) {
+    // the image has not changed since it was last validated: take the
+    // header and layout from the sidecar, skip the read and the checks
+    img->sidecar_ok = 1;
+    img->header = img->sidecar.header;
+    img->layout = img->sidecar.layout;
+  }
+  else {
+    size_t rb = fread(&img->header, sizeof(boot_img_hdr), 1, img->stream);
+    if ((rb!=1) || ferror(img->stream))
+      abort_perror(img->fname);
+    else if (feof(img->stream))
+      abort_printf("%s: cannot read image header\n", img->fname);
+
+    if (check_boot_img_header(img))
+      abort_printf("%s: not a valid Android Boot Image.\n", img->fname);
+  }
+
+  // remember the on-disk layout so updates can tell which sections moved
+  img->orig_header = img->header;
+  img->has_orig = 1;
+
+  // map the whole image read-only so payloads can be written out
+  // without an intermediate heap buffer
+  img->map = mmap(NULL, img->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (img->map == MAP_FAILED)
+    img->map = NULL;
+  else
+    img->map_size = img->size;
 }
 
 
 
-void update_header_entry(t_abootimg* img, char* cmd)
+/* config parsing: the eight header keys live in one sorted table, so a
+ * line costs one tokenizer pass and a binary search instead of a
+ * strcmp cascade. entries are staged into a batch and applied to the
+ * header together once everything parsed, and errors carry the line
+ * they came from. blank lines and '#' comments are skipped, so
+ * templated config files can annotate themselves. */
+
+enum e_cfg_field
+{
+  cfg_bootsize,
+  cfg_cmdline,
+  cfg_kerneladdr,
+  cfg_name,
+  cfg_pagesize,
+  cfg_ramdiskaddr,
+  cfg_secondaddr,
+  cfg_tagsaddr,
+  CFG_NFIELDS
+};
+
+typedef struct
+{
+  char*            key;
+  enum e_cfg_field field;
+} t_cfg_key;
+
+// sorted by key for bsearch
+static const t_cfg_key cfg_keys[] =
+{
+  { "bootsize",    cfg_bootsize    },
+  { "cmdline",     cfg_cmdline     },
+  { "kerneladdr",  cfg_kerneladdr  },
+  { "name",        cfg_name        },
+  { "pagesize",    cfg_pagesize    },
+  { "ramdiskaddr", cfg_ramdiskaddr },
+  { "secondaddr",  cfg_secondaddr  },
+  { "tagsaddr",    cfg_tagsaddr    },
+};
+
+typedef struct
+{
+  unsigned value[CFG_NFIELDS];       /* the numeric fields */
+  char     cmdline[BOOT_ARGS_SIZE];
+  char     name[BOOT_NAME_SIZE];
+  unsigned seen;                     /* one bit per field */
+} t_cfg_batch;
+
+
+int cfg_key_cmp(const void* token, const void* entry)
 {
-  char *p;
-  char *token;
-  char *endtoken;
-  char *value;
+  return strcmp(token, ((const t_cfg_key*)entry)->key);
+}
 
-  p = strchr(cmd, '\n');
+
+// one "key = value" line; where/lineno feed the error messages
+void parse_config_line(char* line, const char* where, int lineno, t_cfg_batch* b)
+{
+  char* p = strchr(line, '\n');
   if (p)
-    *p  = '\0';
+    *p = '\0';
 
-  p = cmd;
-  p += strspn(p, " \t");
-  token = p;
-  
+  p = line + strspn(line, " \t");
+  if (!*p || (*p == '#'))
+    return;
+
+  char* token = p;
   p += strcspn(p, " =\t");
-  endtoken = p;
+  char* endtoken = p;
   p += strspn(p, " \t");
 
   if (*p++ != '=')
-    goto err;
+    abort_printf("%s:%d: bad config entry\n", where, lineno);
 
   p += strspn(p, " \t");
-  value = p;
-
+  char* value = p;
   *endtoken = '\0';
 
-  unsigned valuenum = strtoul(value, NULL, 0);
-  
-  if (!strcmp(token, "cmdline")) {
-    unsigned len = strlen(value);
-    if (len >= BOOT_ARGS_SIZE) 
-      abort_printf("cmdline length (%d) is too long (max %d)", len, BOOT_ARGS_SIZE-1);
-    memset(img->header.cmdline, 0, BOOT_ARGS_SIZE);
-    strcpy((char*)(img->header.cmdline), value);
-  }
-  else if (!strncmp(token, "name", 4)) {
-    strncpy((char*)(img->header.name), value, BOOT_NAME_SIZE);
-    img->header.name[BOOT_NAME_SIZE-1] = '\0';
-  }
-  else if (!strncmp(token, "bootsize", 8)) {
-    if (img->is_blkdev && (img->size != valuenum))
-      abort_printf("%s: cannot change Boot Image size for a block device\n", img->fname);
-    img->size = valuenum;
-  }
-  else if (!strncmp(token, "pagesize", 8)) {
-    img->header.page_size = valuenum;
-  }
-  else if (!strncmp(token, "kerneladdr", 10)) {
-    img->header.kernel_addr = valuenum;
-  }
-  else if (!strncmp(token, "ramdiskaddr", 11)) {
-    img->header.ramdisk_addr = valuenum;
-  }
-  else if (!strncmp(token, "secondaddr", 10)) {
-    img->header.second_addr = valuenum;
-  }
-  else if (!strncmp(token, "tagsaddr", 8)) {
-    img->header.tags_addr = valuenum;
+  const t_cfg_key* k = bsearch(token, cfg_keys,
+                               sizeof(cfg_keys)/sizeof(cfg_keys[0]),
+                               sizeof(cfg_keys[0]), cfg_key_cmp);
+  if (!k)
+    abort_printf("%s:%d: unknown config key '%s'\n", where, lineno, token);
+
+  switch (k->field) {
+    case cfg_cmdline:
+      if (strlen(value) >= BOOT_ARGS_SIZE)
+        abort_printf("%s:%d: cmdline length (%zu) is too long (max %d)\n",
+                     where, lineno, strlen(value), BOOT_ARGS_SIZE-1);
+      memset(b->cmdline, 0, BOOT_ARGS_SIZE);
+      strcpy(b->cmdline, value);
+      break;
+    case cfg_name:
+      strncpy(b->name, value, BOOT_NAME_SIZE);
+      b->name[BOOT_NAME_SIZE-1] = '\0';
+      break;
+    default:
+      b->value[k->field] = strtoul(value, NULL, 0);
   }
-  else
-    goto err;
-  return;
+  b->seen |= 1u << k->field;
+}
+
 
-err:
-  abort_printf("%s: bad config entry\n", token);
+// the staged batch lands on the header in one shot; checks that need
+// the image (bootsize on a block device) happen here, not per line
+void apply_config(t_abootimg* img, t_cfg_batch* b)
+{
+  if (b->seen & (1u << cfg_cmdline))
+    memcpy(img->header.cmdline, b->cmdline, BOOT_ARGS_SIZE);
+  if (b->seen & (1u << cfg_name))
+    memcpy(img->header.name, b->name, BOOT_NAME_SIZE);
+  if (b->seen & (1u << cfg_bootsize)) {
+    if (img->is_blkdev && (img->size != b->value[cfg_bootsize]))
+      abort_printf("%s: cannot change Boot Image size for a block device\n", img->fname);
+    img->size = b->value[cfg_bootsize];
+  }
+  if (b->seen & (1u << cfg_pagesize))
+    img->header.page_size = b->value[cfg_pagesize];
+  if (b->seen & (1u << cfg_kerneladdr))
+    img->header.kernel_addr = b->value[cfg_kerneladdr];
+  if (b->seen & (1u << cfg_ramdiskaddr))
+    img->header.ramdisk_addr = b->value[cfg_ramdiskaddr];
+  if (b->seen & (1u << cfg_secondaddr))
+    img->header.second_addr = b->value[cfg_secondaddr];
+  if (b->seen & (1u << cfg_tagsaddr))
+    img->header.tags_addr = b->value[cfg_tagsaddr];
 }
 
 
 void update_header(t_abootimg* img)
 {
+  t_cfg_batch batch;
+  memset(&batch, 0, sizeof(batch));
+
   if (img->config_fname) {
     FILE* config_file = fopen(img->config_fname, "r");
     if (!config_file)
@@ -512,87 +1125,531 @@ void update_header(t_abootimg* img)
 
     printf("reading config file %s\n", img->config_fname);
 
+    // getline grows one buffer and reuses it for every line
     char* line = NULL;
     size_t len = 0;
-    int read;
+    int lineno = 0;
+
+    while (getline(&line, &len, config_file) != -1)
+      parse_config_line(line, img->config_fname, ++lineno, &batch);
 
-    while ((read = getline(&line, &len, config_file)) != -1) {
-      update_header_entry(img, line);
-      free(line);
-      line = NULL;
-    }
     if (ferror(config_file))
       abort_perror(img->config_fname);
-  }
 
-  unsigned len = strlen(config_args);
-  if (len) {
-    FILE* config_file = fmemopen(config_args, len, "r");
-    if  (!config_file)
-      abort_perror("-c args");
+    free(line);
+    fclose(config_file);
+  }
 
+  if (*img->config_args) {
     printf("reading config args\n");
 
-    char* line = NULL;
-    size_t len = 0;
-    int read;
+    // the -c string is ours: cut it in place, no fmemopen round trip
+    char* p = img->config_args;
+    int lineno = 0;
 
-    while ((read = getline(&line, &len, config_file)) != -1) {
-      update_header_entry(img, line);
-      free(line);
-      line = NULL;
-    }
-    if (ferror(config_file))
-      abort_perror("-c args");
+    while (p && *p)
+      parse_config_line(strsep(&p, "\n"), "-c args", ++lineno, &batch);
   }
+
+  if (batch.seen)
+    apply_config(img, &batch);
 }
 
 
 
-void update_images(t_abootimg *img)
+/* in-process initrd repacking (--repack-ramdisk): builds the same
+ * archive as "find | sort | cpio -o -H newc | gzip" in the pack-initrd
+ * script, but with no child processes, no temp files, and the gzip
+ * stage compressing independent blocks on all cores (pigz-style:
+ * raw deflate blocks joined at full-flush points, one gzip member). */
+
+typedef struct
 {
-  unsigned page_size = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
-  unsigned ssize = img->header.second_size;
-  unsigned dsize = img->header.dtbs_size;
+  char*    data;
+  unsigned size;
+  unsigned cap;
+} t_buf;
 
-  if (!page_size)
-    abort_printf("%s: Image page size is null\n", img->fname);
 
-  unsigned n = (ksize + page_size - 1) / page_size;
-  unsigned m = (rsize + page_size - 1) / page_size;
-  unsigned o = (ssize + page_size - 1) / page_size;
-  unsigned p = (dsize + page_size - 1) / page_size;
+void buf_append(t_buf* b, const void* data, unsigned len)
+{
+  if (b->size + len > b->cap) {
+    b->cap = (b->cap ? b->cap * 2 : 65536);
+    while (b->size + len > b->cap)
+      b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+    if (!b->data)
+      abort_perror(NULL);
+  }
+  memcpy(b->data + b->size, data, len);
+  b->size += len;
+}
 
-  unsigned roffset = (1+n)*page_size;
-  unsigned soffset = (1+n+m)*page_size;
-  unsigned doffset = (1+n+m+o)*page_size;
 
-  if (img->kernel_fname) {
-    printf("reading kernel from %s\n", img->kernel_fname);
-    FILE* stream = fopen(img->kernel_fname, "r");
-    if (!stream)
-      abort_perror(img->kernel_fname);
+void cpio_pad4(t_buf* b)
+{
+  static const char zero[4] = {0};
+  if (b->size % 4)
+    buf_append(b, zero, 4 - (b->size % 4));
+}
+
+
+void cpio_emit(t_buf* b, char* name, struct stat* st, char* filedata, unsigned filesize)
+{
+  char hdr[111];
+
+  snprintf(hdr, sizeof(hdr),
+           "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+           (unsigned)st->st_ino, (unsigned)st->st_mode,
+           (unsigned)st->st_uid, (unsigned)st->st_gid,
+           (unsigned)st->st_nlink, (unsigned)st->st_mtime,
+           filesize,
+           major(st->st_dev), minor(st->st_dev),
+           major(st->st_rdev), minor(st->st_rdev),
+           (unsigned)strlen(name)+1, 0);
+
+  buf_append(b, hdr, 110);
+  buf_append(b, name, strlen(name)+1);
+  cpio_pad4(b);
+  if (filesize) {
+    buf_append(b, filedata, filesize);
+    cpio_pad4(b);
+  }
+}
+
+
+void collect_names(char* root, char* rel, char*** names, int* num, int* cap)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+  DIR* dir = opendir(path);
+  if (!dir)
+    abort_perror(path);
+
+  struct dirent* de;
+  while ((de = readdir(dir))) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+
+    char* child = malloc(strlen(rel) + strlen(de->d_name) + 2);
+    if (!child)
+      abort_perror(NULL);
+    sprintf(child, "%s/%s", rel, de->d_name);
+
+    if (*num >= *cap) {
+      *cap = (*cap ? *cap * 2 : 256);
+      *names = realloc(*names, *cap * sizeof(char*));
+      if (!*names)
+        abort_perror(NULL);
+    }
+    (*names)[(*num)++] = child;
+
+    snprintf(path, sizeof(path), "%s/%s", root, child);
     struct stat st;
-    if (fstat(fileno(stream), &st))
-      abort_perror(img->kernel_fname);
-    ksize = st.st_size;
-    char* k = malloc(ksize);
-    if (!k)
-      abort_perror("");
-    size_t rb = fread(k, ksize, 1, stream);
-    if ((rb!=1) || ferror(stream))
-      abort_perror(img->kernel_fname);
-    else if (feof(stream))
-      abort_printf("%s: cannot read kernel\n", img->kernel_fname);
-    fclose(stream);
-    img->header.kernel_size = ksize;
-    img->kernel = k;
+    if (lstat(path, &st))
+      abort_perror(path);
+    if (S_ISDIR(st.st_mode))
+      collect_names(root, child, names, num, cap);
   }
+  closedir(dir);
+}
 
-  if (img->ramdisk_fname) {
-    printf("reading ramdisk from %s\n", img->ramdisk_fname);
+
+int name_cmp(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+// archive the directory tree as newc cpio, same member order and
+// naming ("." first, then ./path, sorted) as the pack-initrd script
+void cpio_archive(char* root, t_buf* b)
+{
+  char** names = NULL;
+  int num = 0, cap = 0;
+  int i;
+
+  collect_names(root, ".", &names, &num, &cap);
+  qsort(names, num, sizeof(char*), name_cmp);
+
+  struct stat st;
+  if (lstat(root, &st))
+    abort_perror(root);
+  cpio_emit(b, ".", &st, NULL, 0);
+
+  for (i=0; i<num; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, names[i]);
+
+    if (lstat(path, &st))
+      abort_perror(path);
+
+    char* data = NULL;
+    unsigned size = 0;
+
+    if (S_ISREG(st.st_mode)) {
+      size = st.st_size;
+      if (size) {
+        data = malloc(size);
+        if (!data)
+          abort_perror(NULL);
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+          abort_perror(path);
+        if (read(fd, data, size) != (ssize_t)size)
+          abort_perror(path);
+        close(fd);
+      }
+    }
+    else if (S_ISLNK(st.st_mode)) {
+      size = st.st_size;
+      data = malloc(size+1);
+      if (!data)
+        abort_perror(NULL);
+      if (readlink(path, data, size+1) != (ssize_t)size)
+        abort_perror(path);
+    }
+
+    cpio_emit(b, names[i], &st, data, size);
+    free(data);
+    free(names[i]);
+  }
+  free(names);
+
+  memset(&st, 0, sizeof(st));
+  st.st_nlink = 1;
+  cpio_emit(b, "TRAILER!!!", &st, NULL, 0);
+}
+
+
+#define GZIP_BLOCK_SIZE (1024*1024)
+
+typedef struct
+{
+  unsigned char* in;
+  unsigned       in_len;
+  unsigned char* out;
+  unsigned       out_len;
+  int            last;
+  unsigned long  crc;
+} t_gzip_block;
+
+typedef struct
+{
+  t_gzip_block*   blocks;
+  int             num_blocks;
+  int             next;
+  pthread_mutex_t lock;
+} t_gzip_pool;
+
+
+void* gzip_block_worker(void* arg)
+{
+  t_gzip_pool* pool = (t_gzip_pool*)arg;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    int i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->num_blocks)
+      break;
+
+    t_gzip_block* blk = &pool->blocks[i];
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // raw deflate: the gzip wrapper is emitted once around all blocks
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      abort_printf("deflateInit2 failed");
+
+    unsigned cap = deflateBound(&zs, blk->in_len) + 16;
+    blk->out = malloc(cap);
+    if (!blk->out)
+      abort_perror(NULL);
+
+    zs.next_in = blk->in;
+    zs.avail_in = blk->in_len;
+    zs.next_out = blk->out;
+    zs.avail_out = cap;
+
+    // full flush aligns the block so the next one can follow it
+    int ret = deflate(&zs, blk->last ? Z_FINISH : Z_FULL_FLUSH);
+    if (blk->last ? (ret != Z_STREAM_END) : (ret != Z_OK))
+      abort_printf("deflate failed (%d)", ret);
+
+    blk->out_len = cap - zs.avail_out;
+    blk->crc = crc32(0, blk->in, blk->in_len);
+    deflateEnd(&zs);
+  }
+
+  return NULL;
+}
+
+
+// gzip the archive block-parallel into one standard gzip member
+void gzip_parallel(t_buf* in, t_buf* out)
+{
+  static const unsigned char gzip_hdr[10] =
+    { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+  int num_blocks = (in->size + GZIP_BLOCK_SIZE - 1) / GZIP_BLOCK_SIZE;
+  if (!num_blocks)
+    num_blocks = 1;
+
+  t_gzip_pool pool;
+  pool.blocks = calloc(num_blocks, sizeof(t_gzip_block));
+  if (!pool.blocks)
+    abort_perror(NULL);
+  pool.num_blocks = num_blocks;
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+
+  int i;
+  for (i=0; i<num_blocks; i++) {
+    pool.blocks[i].in = (unsigned char*)in->data + (unsigned)i * GZIP_BLOCK_SIZE;
+    pool.blocks[i].in_len = (i == num_blocks-1)
+                            ? in->size - (unsigned)i * GZIP_BLOCK_SIZE
+                            : GZIP_BLOCK_SIZE;
+    pool.blocks[i].last = (i == num_blocks-1);
+  }
+
+  int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1)
+    num_workers = 1;
+  if (num_workers > num_blocks)
+    num_workers = num_blocks;
+
+  pthread_t workers[num_workers];
+  for (i=0; i<num_workers; i++)
+    if (pthread_create(&workers[i], NULL, gzip_block_worker, &pool))
+      abort_perror("pthread_create");
+  for (i=0; i<num_workers; i++)
+    pthread_join(workers[i], NULL);
+
+  buf_append(out, gzip_hdr, sizeof(gzip_hdr));
+
+  unsigned long crc = crc32(0, NULL, 0);
+  for (i=0; i<num_blocks; i++) {
+    buf_append(out, pool.blocks[i].out, pool.blocks[i].out_len);
+    crc = crc32_combine(crc, pool.blocks[i].crc, pool.blocks[i].in_len);
+    free(pool.blocks[i].out);
+  }
+  free(pool.blocks);
+
+  unsigned char trailer[8];
+  trailer[0] = crc & 0xff;        trailer[1] = (crc >> 8) & 0xff;
+  trailer[2] = (crc >> 16) & 0xff; trailer[3] = (crc >> 24) & 0xff;
+  trailer[4] = in->size & 0xff;    trailer[5] = (in->size >> 8) & 0xff;
+  trailer[6] = (in->size >> 16) & 0xff; trailer[7] = (in->size >> 24) & 0xff;
+  buf_append(out, trailer, sizeof(trailer));
+}
+
+
+void repack_ramdisk(t_abootimg* img)
+{
+  printf("repacking ramdisk from %s\n", img->ramdisk_dir);
+
+  t_buf archive = {0};
+  t_buf gz = {0};
+
+  cpio_archive(img->ramdisk_dir, &archive);
+  gzip_parallel(&archive, &gz);
+  free(archive.data);
+
+  printf(" .. %u bytes (%u compressed)\n", archive.size, gz.size);
+
+  img->header.ramdisk_size = gz.size;
+  img->ramdisk = gz.data;
+}
+
+
+/* dtb layout cache (<image>.dtbcache): one line per entry with the dtb
+ * file's sha1, size, mtime and the absolute offset its bytes hold in
+ * the image. A dtb file whose size and mtime still match is trusted
+ * unchanged, so a nightly dtbs update only re-reads and re-lays-out
+ * the entries that really changed. */
+
+typedef struct s_dtb_cache
+{
+  char     sha1[41];
+  unsigned size;
+  long     mtime;
+  unsigned offset;
+} t_dtb_cache;
+
+
+void sha1_hex(void* data, unsigned size, char hex[41])
+{
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  sha1_ctx ctx;
+  int i;
+
+  sha1_init(&ctx);
+  sha1_update(&ctx, data, size);
+  sha1_final(&ctx, digest);
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    sprintf(hex + 2*i, "%02x", digest[i]);
+}
+
+
+int load_dtb_cache(t_abootimg* img, t_dtb_cache* cache, int max)
+{
+  char fname[PATH_MAX];
+  snprintf(fname, sizeof(fname), "%s.dtbcache", img->fname);
+
+  FILE* f = fopen(fname, "r");
+  if (!f)
+    return 0;
+
+  int count = 0;
+  while ((count < max)
+         && (fscanf(f, "%40s %u %ld %u", cache[count].sha1, &cache[count].size,
+                    &cache[count].mtime, &cache[count].offset) == 4))
+    count++;
+  fclose(f);
+  return count;
+}
+
+
+void save_dtb_cache(t_abootimg* img, t_dtb_cache* cache, int count)
+{
+  char fname[PATH_MAX];
+  snprintf(fname, sizeof(fname), "%s.dtbcache", img->fname);
+
+  FILE* f = fopen(fname, "w");
+  if (!f)
+    return; // the cache is an optimization, not worth aborting over
+
+  int i;
+  for (i = 0; i < count; i++)
+    fprintf(f, "%s %u %ld %u\n", cache[i].sha1, cache[i].size,
+            cache[i].mtime, cache[i].offset);
+  fclose(f);
+}
+
+
+// update_images stages its entries here instead of saving them itself:
+// until the writer has finished, the image does not hold the offsets
+// the cache would promise, and an abort or interrupted flash in
+// between would leave a cache that silently corrupts the next update
+void save_pending_dtb_cache(t_abootimg* img)
+{
+  if (!img->dtb_cache_pending)
+    return;
+  save_dtb_cache(img, img->dtb_cache_pending, img->dtb_cache_npending);
+  img->dtb_cache_pending = NULL;
+}
+
+
+void update_images(t_abootimg *img)
+{
+  unsigned page_size = img->header.page_size;
+
+  // old layout, as the image sits on disk (update_header may already
+  // have changed page_size in img->header)
+  boot_img_hdr* oh = img->has_orig ? &img->orig_header : &img->header;
+  unsigned old_psize = oh->page_size;
+
+  unsigned ksize = oh->kernel_size;
+  unsigned rsize = oh->ramdisk_size;
+  unsigned ssize = oh->second_size;
+  unsigned dsize = oh->dtbs_size;
+
+  if (!page_size || !old_psize)
+    abort_printf("%s: Image page size is null\n", img->fname);
+
+  t_layout old_layout;
+  compute_layout(oh, &old_layout);
+
+  unsigned p;
+  unsigned roffset = old_layout.ramdisk_offset;
+  unsigned soffset = old_layout.second_offset;
+  unsigned doffset = old_layout.dtbs_offset;
+  unsigned goffset = old_layout.sig_offset;
+
+  // one arena mapping sized for everything this update may materialize
+  if (img->kernel_fname || img->ramdisk_fname || img->second_fname || img->dtbs_fname)
+    arena_reserve(img, ksize + rsize + ssize + dsize + 8*page_size);
+
+  if (img->kernel_fname) {
+    printf("reading kernel from %s\n", img->kernel_fname);
+    FILE* stream = fopen(img->kernel_fname, "r");
+    if (!stream)
+      abort_perror(img->kernel_fname);
+    struct stat st;
+    if (fstat(fileno(stream), &st))
+      abort_perror(img->kernel_fname);
+    ksize = st.st_size;
+    if (img->stream_bufsz)
+      // streamed by write_bootimg, only the size is needed now
+      img->kernel_src = img->kernel_fname;
+    else {
+      char* k = arena_alloc(img, ksize);
+      size_t rb = fread(k, ksize, 1, stream);
+      if ((rb!=1) || ferror(stream))
+        abort_perror(img->kernel_fname);
+      else if (feof(stream))
+        abort_printf("%s: cannot read kernel\n", img->kernel_fname);
+      img->kernel = k;
+    }
+    fclose(stream);
+    img->header.kernel_size = ksize;
+  }
+  else if (page_size != old_psize) {
+    // kernel itself moves when the page size changes
+    printf (" move  kernel %u bytes from 0x%08x\n", ksize, old_psize);
+    img->kernel_from = old_psize;
+  }
+
+  // where the ramdisk will land with the updated kernel in front of it.
+  // sizes become final top-down, so the layout is recomputed as each
+  // one settles; only the already-settled offsets are read
+  compute_layout(&img->header, &img->layout);
+  unsigned new_roffset = img->layout.ramdisk_offset;
+
+  if (img->ramdisk_dir)
+    repack_ramdisk(img);
+  else if (img->ramdisk_nparts > 1) {
+    // overlay builds: the ramdisk is the concatenation of the -r parts.
+    // they stay a scatter list here and are gathered back-to-back by
+    // write_bootimg; no combined buffer is ever materialized
+    printf("reading ramdisk from %d parts\n", img->ramdisk_nparts);
+
+    img->ramdisk_part_data = (char**)arena_alloc(img, img->ramdisk_nparts * sizeof(char*));
+    img->ramdisk_part_size = (unsigned*)arena_alloc(img, img->ramdisk_nparts * sizeof(unsigned));
+
+    rsize = 0;
+    int ipart;
+    for (ipart = 0; ipart < img->ramdisk_nparts; ipart++) {
+      char* pname = img->ramdisk_parts[ipart];
+      printf(" .. part %s\n", pname);
+
+      FILE* stream = fopen(pname, "r");
+      if (!stream)
+        abort_perror(pname);
+      struct stat st;
+      if (fstat(fileno(stream), &st))
+        abort_perror(pname);
+
+      img->ramdisk_part_size[ipart] = st.st_size;
+      if (img->stream_bufsz)
+        img->ramdisk_part_data[ipart] = NULL;  // streamed at write time
+      else {
+        char* r = arena_alloc(img, st.st_size);
+        size_t rb = fread(r, st.st_size, 1, stream);
+        if ((rb!=1) || ferror(stream))
+          abort_perror(pname);
+        img->ramdisk_part_data[ipart] = r;
+      }
+      fclose(stream);
+      rsize += st.st_size;
+    }
+    img->header.ramdisk_size = rsize;
+  }
+  else if (img->ramdisk_fname) {
+    printf("reading ramdisk from %s\n", img->ramdisk_fname);
     FILE* stream = fopen(img->ramdisk_fname, "r");
     if (!stream)
       abort_perror(img->ramdisk_fname);
@@ -600,36 +1657,30 @@ void update_images(t_abootimg *img)
     if (fstat(fileno(stream), &st))
       abort_perror(img->ramdisk_fname);
     rsize = st.st_size;
-    char* r = malloc(rsize);
-    if (!r)
-      abort_perror("");
-    size_t rb = fread(r, rsize, 1, stream);
-    if ((rb!=1) || ferror(stream))
-      abort_perror(img->ramdisk_fname);
-    else if (feof(stream))
-      abort_printf("%s: cannot read ramdisk\n", img->ramdisk_fname);
+    if (img->stream_bufsz)
+      img->ramdisk_src = img->ramdisk_fname;
+    else {
+      char* r = arena_alloc(img, rsize);
+      size_t rb = fread(r, rsize, 1, stream);
+      if ((rb!=1) || ferror(stream))
+        abort_perror(img->ramdisk_fname);
+      else if (feof(stream))
+        abort_printf("%s: cannot read ramdisk\n", img->ramdisk_fname);
+      img->ramdisk = r;
+    }
     fclose(stream);
     img->header.ramdisk_size = rsize;
-    img->ramdisk = r;
   }
-  else if (img->kernel) {
-    // if kernel is updated, copy the ramdisk from original image
-
-    printf (" copy  ramdisk %u bytes from 0x%08x\n", rsize, roffset);
-
-    char* r = malloc(rsize);
-    if (!r)
-      abort_perror("");
-    if (fseek(img->stream, roffset, SEEK_SET))
-      abort_perror(img->fname);
-    size_t rb = fread(r, rsize, 1, img->stream);
-    if ((rb!=1) || ferror(img->stream))
-      abort_perror(img->fname);
-    else if (feof(img->stream))
-      abort_printf("%s: cannot read ramdisk\n", img->fname);
-    img->ramdisk = r;
+  else if (new_roffset != roffset) {
+    // ramdisk moved (kernel grew/shrank across a page boundary, or the
+    // page size changed): just record where it sits, no heap copy
+    printf (" move  ramdisk %u bytes from 0x%08x\n", rsize, roffset);
+    img->ramdisk_from = roffset;
   }
 
+  compute_layout(&img->header, &img->layout);
+  unsigned new_soffset = img->layout.second_offset;
+
   if (img->second_fname) {
     printf("reading second stage from %s\n", img->second_fname);
     FILE* stream = fopen(img->second_fname, "r");
@@ -639,35 +1690,28 @@ void update_images(t_abootimg *img)
     if (fstat(fileno(stream), &st))
       abort_perror(img->second_fname);
     ssize = st.st_size;
-    char* s = malloc(ssize);
-    if (!s)
-      abort_perror("");
-    size_t rb = fread(s, ssize, 1, stream);
-    if ((rb!=1) || ferror(stream))
-      abort_perror(img->second_fname);
-    else if (feof(stream))
-      abort_printf("%s: cannot read second stage\n", img->second_fname);
+    if (img->stream_bufsz)
+      img->second_src = img->second_fname;
+    else {
+      char* s = arena_alloc(img, ssize);
+      size_t rb = fread(s, ssize, 1, stream);
+      if ((rb!=1) || ferror(stream))
+        abort_perror(img->second_fname);
+      else if (feof(stream))
+        abort_printf("%s: cannot read second stage\n", img->second_fname);
+      img->second = s;
+    }
     fclose(stream);
     img->header.second_size = ssize;
-    img->second = s;
   }
-  else if (img->ramdisk && img->header.second_size) {
-    // if ramdisk is updated, copy the second stage from original image
-    printf (" copy second %u bytes from 0x%08x\n", ssize, soffset);
-
-    char* s = malloc(ssize);
-    if (!s)
-      abort_perror("");
-    if (fseek(img->stream, soffset, SEEK_SET))
-      abort_perror(img->fname);
-    size_t rb = fread(s, ssize, 1, img->stream);
-    if ((rb!=1) || ferror(img->stream))
-      abort_perror(img->fname);
-    else if (feof(img->stream))
-      abort_printf("%s: cannot read second stage\n", img->fname);
-    img->second = s;
+  else if (img->header.second_size && (new_soffset != soffset)) {
+    printf (" move  second %u bytes from 0x%08x\n", ssize, soffset);
+    img->second_from = soffset;
   }
 
+  compute_layout(&img->header, &img->layout);
+  unsigned new_doffset = img->layout.dtbs_offset;
+
   if (img->dtbs_fname) {
     printf("reading dtbs ...\n");
 
@@ -688,11 +1732,10 @@ void update_images(t_abootimg *img)
     dsize = st.st_size;
 
     //alloc memmory and clear for dtbh (not more than 1 pagesize)
-    //char* d = malloc(dsize);
-    char* d = calloc(page_size,1);
-
-    if (!d)
-      abort_perror("");
+    if ((dsize < sizeof(dtbs_t)) || (dsize > page_size))
+      abort_printf("%s: DTBH must fit one %u byte page\n", dtbname, page_size);
+    char* d = arena_alloc(img, page_size);
+    memset(d, 0, page_size);
     // read
     size_t rb = fread(d, dsize, 1, stream);
     if ((rb!=1) || ferror(stream))
@@ -704,44 +1747,118 @@ void update_images(t_abootimg *img)
     img->dtbh = d;
 
 
-    // alloc and load each dtbs
+    // alloc and load each dtbs; the table is validated before anything
+    // trusts num_entries (entry offsets are recomputed below)
     dtbs_t *dtbh = (dtbs_t *)d;
+    if (dtbh->magic != DTBH_MAGIC)
+      abort_printf("%s: bad DTBH magic 0x%08x\n", dtbname, dtbh->magic);
+    if (dtbh->num_entries > (dsize - sizeof(dtbs_t)) / sizeof(dt_entry_t))
+      abort_printf("%s: DTBH num_entries %u exceeds the file\n",
+                   dtbname, dtbh->num_entries);
+    int ne = dtbh->num_entries;
 
     // alloc ptr table for dtbs
-    img->dtbs = (void **)malloc(dtbh->num_entries * sizeof(void*));
+    img->dtbs = (void **)arena_alloc(img, ne * sizeof(void*));
+    img->dtb_from = (unsigned*)arena_alloc(img, ne * sizeof(unsigned));
+    img->dtb_clean = (int*)arena_alloc(img, ne * sizeof(int));
+    memset(img->dtb_from, 0, ne * sizeof(unsigned));
+    memset(img->dtb_clean, 0, ne * sizeof(int));
+
+    // the cache only helps while the dtbs section itself stays put:
+    // once it moves, its old bytes may be clobbered by the section
+    // moves that run before the dtb writes
+    t_dtb_cache* cache = (t_dtb_cache*)arena_alloc(img, ne * sizeof(t_dtb_cache));
+    t_dtb_cache* newc = (t_dtb_cache*)arena_alloc(img, ne * sizeof(t_dtb_cache));
+    int ncache = 0;
+    if (img->has_orig && (new_doffset == doffset))
+      ncache = load_dtb_cache(img, cache, ne);
 
     // entryes
     dt_entry_t *dt = (dt_entry_t *)(d + sizeof(dtbs_t));
 
     int ientry;
-    for (ientry = 0, p = 1; ientry<dtbh->num_entries; ientry++) {
+    for (ientry = 0, p = 1; ientry<ne; ientry++) {
       // generate dtb name
       sprintf(dtbname,"%s.dtb_p%d",img->dtbs_fname, ientry);
 
       //printf(".. dtb from %s\n",dtbname);
       printf (" .. dtb %s offset 0x%08x, size 0x%08x\n", dtbname, dt[ientry].offset, dt[ientry].dtb_size);
 
-      FILE* dtbs_file = fopen(dtbname, "r");
-      if (!dtbs_file)
-        abort_perror(dtbname);
-
       //get size of dtb file
       struct stat st;
-      if (fstat(fileno(dtbs_file), &st))
+      if (stat(dtbname, &st))
         abort_perror(dtbname);
 
-      void* dp = (void *)malloc(st.st_size);
+      unsigned new_abs = new_doffset + p * page_size;
+
+      // a size+mtime match means the bytes are already in the image at
+      // the cached offset; no need to re-read the dtb file at all
+      if ((ientry < ncache)
+          && (cache[ientry].size == (unsigned)st.st_size)
+          && (cache[ientry].mtime == (long)st.st_mtime)
+          && (cache[ientry].offset >= doffset + page_size)
+          && (cache[ientry].offset + st.st_size <= doffset + oh->dtbs_size)) {
+        img->dtbs[ientry] = NULL;
+        if (cache[ientry].offset == new_abs) {
+          img->dtb_clean[ientry] = 1;
+          printf (" .. dtb %s unchanged, kept in place\n", dtbname);
+        }
+        else {
+          img->dtb_from[ientry] = cache[ientry].offset;
+          printf (" .. dtb %s unchanged, moved within image\n", dtbname);
+        }
+        memcpy(newc[ientry].sha1, cache[ientry].sha1, sizeof(newc[ientry].sha1));
+      }
+      else {
+        FILE* dtbs_file = fopen(dtbname, "r");
+        if (!dtbs_file)
+          abort_perror(dtbname);
+
+        void* dp = arena_alloc(img, st.st_size);
 
-      // read dtb file
-      size_t rb = fread(dp, st.st_size, 1, dtbs_file);
+        // read dtb file
+        size_t rb = fread(dp, st.st_size, 1, dtbs_file);
 
-      if ((rb!=1) || ferror(dtbs_file))
-        abort_perror(dtbname);
-      else if (feof(dtbs_file))
-        abort_printf("%s: cannot read DTB\n", dtbname);
+        if ((rb!=1) || ferror(dtbs_file))
+          abort_perror(dtbname);
+        else if (feof(dtbs_file))
+          abort_printf("%s: cannot read DTB\n", dtbname);
+        fclose(dtbs_file);
+
+        // store dtb to image table
+        img->dtbs[ientry] = dp;
+        sha1_hex(dp, st.st_size, newc[ientry].sha1);
+      }
+
+      // identical blobs collapse onto one shared offset: consecutive
+      // hw_rev ranges often point at the same dtb compiled repeatedly,
+      // and the offset/dtb_size indirection permits the sharing
+      int dup = -1;
+      int jentry;
+      for (jentry = 0; jentry < ientry; jentry++)
+        if ((newc[jentry].size == (unsigned)st.st_size)
+            && !memcmp(newc[jentry].sha1, newc[ientry].sha1, sizeof(newc[jentry].sha1))) {
+          dup = jentry;
+          break;
+        }
 
-      // store dtb to image table
-      img->dtbs[ientry] = dp;
+      newc[ientry].size = st.st_size;
+      newc[ientry].mtime = st.st_mtime;
+
+      if (dup >= 0) {
+        dt[ientry].offset = dt[dup].offset;
+        dt[ientry].dtb_size = st.st_size;
+        // entry 'dup' materializes the bytes, this one only points
+        img->dtbs[ientry] = NULL;
+        img->dtb_from[ientry] = 0;
+        img->dtb_clean[ientry] = 1;
+        newc[ientry].offset = new_doffset + dt[dup].offset;
+
+        printf (" .. identical to dtb %d, shared at 0x%08x\n", dup, dt[dup].offset);
+        continue;
+      }
+
+      newc[ientry].offset = new_abs;
 
       // update size of dtb
       dt[ientry].offset = p * page_size;
@@ -750,59 +1867,55 @@ void update_images(t_abootimg *img)
       printf (" .. new offset 0x%08x, size 0x%08x\n", dt[ientry].offset, dt[ientry].dtb_size);
 
       // update header dtbs p pages count (for next loop)
-      p+=  (st.st_size + page_size - 1) / page_size;
+      p += layout_pages(&img->layout, st.st_size);
     }; // for loop
 
+    // in-image moves clobber each other unless they all shift the same
+    // way; the odd mixed run is staged through memory instead
+    int up = 0;
+    int down = 0;
+    for (ientry = 0; ientry<ne; ientry++)
+      if (img->dtb_from[ientry]) {
+        unsigned to = new_doffset + dt[ientry].offset;
+        if (to > img->dtb_from[ientry]) up = 1;
+        if (to < img->dtb_from[ientry]) down = 1;
+      }
+    if (up && down)
+      for (ientry = 0; ientry<ne; ientry++)
+        if (img->dtb_from[ientry]) {
+          void* dp = arena_alloc(img, dt[ientry].dtb_size);
+          if (pread(fileno(img->stream), dp, dt[ientry].dtb_size,
+                    img->dtb_from[ientry]) != (ssize_t)dt[ientry].dtb_size)
+            abort_perror(img->fname);
+          img->dtbs[ientry] = dp;
+          img->dtb_from[ientry] = 0;
+        }
+
     // update header dtbs_size
     img->header.dtbs_size = p * page_size;
-  }
-  else if (img->header.dtbs_size) {
-    printf (" copy  dtbs %u bytes from 0x%08x\n", dsize, doffset);
 
-    // if *** is updated, copy the dtbs from original image
-    char* d = malloc(dsize);
-    if (!d)
-      abort_perror("");
-    if (fseek(img->stream, doffset, SEEK_SET))
-      abort_perror(img->fname);
-    size_t rb = fread(d, dsize, 1, img->stream);
-    if ((rb!=1) || ferror(img->stream))
-      abort_perror(img->fname);
-    else if (feof(img->stream))
-      abort_printf("%s: cannot read dtts\n", img->fname);
-
-
-    // store dtb structure header
-    img->dtbh = d;
-
-    // populate dtbs table
-    dtbs_t *dtbh = (dtbs_t *)d;
-
-    // alloc ptr table for dtbs
-    img->dtbs = (void **)malloc(dtbh->num_entries * sizeof(void*));
-
-    // entryes
-    dt_entry_t *dt = (dt_entry_t *)(d + sizeof(dtbs_t));
-
-    int ientry;
-    for (ientry = 0; ientry<dtbh->num_entries; ientry++) {
-
-      // store dtb to image table
-      img->dtbs[ientry] = (void*)(d + dt[ientry].offset);
-    };
+    img->dtb_cache_pending = newc;
+    img->dtb_cache_npending = ne;
+  }
+  else if (img->header.dtbs_size && (new_doffset != doffset)) {
+    // dtbs moved as a whole; entry offsets inside the blob are
+    // relative and stay valid
+    printf (" move  dtbs %u bytes from 0x%08x\n", dsize, doffset);
+    img->dtbs_from = doffset;
   }
 
   // update signature? (read from file, or memory)
-  // offset is (1+n+m+o+p)
   memcpy(img->signature, "SEANDROIDENFORCE", sizeof("SEANDROIDENFORCE"));
 
+  // all sizes are final now: compute the layout the writers will use
+  compute_layout(&img->header, &img->layout);
 
-  n = (img->header.kernel_size + page_size - 1) / page_size;
-  m = (img->header.ramdisk_size + page_size - 1) / page_size;
-  o = (img->header.second_size + page_size - 1) / page_size;
-  p = (img->header.dtbs_size + page_size - 1) / page_size;
+  // the signature only needs rewriting when it moved or was supplied
+  unsigned new_goffset = img->layout.sig_offset;
+  img->dirty_signature = !img->has_orig || img->signature_fname
+                         || (new_goffset != goffset);
 
-  unsigned total_size = (1+n+m+o+p+1)*page_size;
+  unsigned total_size = img->layout.total_size;
 
   if (!img->size)
     img->size = total_size;
@@ -812,504 +1925,2188 @@ void update_images(t_abootimg *img)
 
 
 
-void write_bootimg(t_abootimg* img)
+// one process-wide zero page, shared between jobs: it is only ever
+// read, so it is safe to hand the same buffer to every worker
+char* get_padding(unsigned psize)
 {
-  unsigned psize;
-  char* padding;
+  static char* padding = NULL;
+  static unsigned padding_size = 0;
+  static pthread_mutex_t padding_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_mutex_lock(&padding_lock);
+  if (psize > padding_size) {
+    // the old buffer may still be in use by another worker, leave it be
+    padding = calloc(psize, 1);
+    if (!padding)
+      abort_perror("");
+    padding_size = psize;
+  }
+  char* p = padding;
+  pthread_mutex_unlock(&padding_lock);
+  return p;
+}
 
-  printf ("Writing Boot Image %s\n", img->fname);
 
-  psize = img->header.page_size;
-  padding = calloc(psize, 1);
-  if (!padding)
-    abort_perror("");
+// zero-fill [offset, offset+len) of the image: on a regular file the
+// range becomes a hole (fresh space through ftruncate, old data punched
+// out) so padding costs neither write I/O nor disk blocks; a block
+// device has no holes, there the zero page is written out as before
+void write_padding(t_abootimg* img, unsigned offset, unsigned len)
+{
+  if (!len)
+    return;
+
+  fflush(img->stream);
+  int fd = fileno(img->stream);
 
-  unsigned n = (img->header.kernel_size + psize - 1) / psize;
-  unsigned m = (img->header.ramdisk_size + psize - 1) / psize;
-  unsigned o = (img->header.second_size + psize - 1) / psize;
-  unsigned p = (img->header.dtbs_size + psize - 1) / psize;
+  if (!img->is_blkdev) {
+    struct stat st;
+    if (fstat(fd, &st))
+      abort_perror(img->fname);
 
-  printf ("   header %zu\n", sizeof(img->header));
+    if (st.st_size <= (off_t)offset) {
+      // past EOF: extending the file is enough, the range reads back
+      // as zeroes without ever hitting the disk
+      if (ftruncate(fd, offset + len))
+        abort_perror(img->fname);
+      return;
+    }
 
-  if (fseek(img->stream, 0, SEEK_SET))
-    abort_perror(img->fname);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // rewriting over a previous image: drop the blocks instead of
+    // writing zeroes over them
+    if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, len)) {
+      if ((st.st_size < (off_t)(offset + len)) && ftruncate(fd, offset + len))
+        abort_perror(img->fname);
+      return;
+    }
+#endif
+    // filesystem without hole support: fall through to a plain write
+  }
 
-  fwrite(&img->header, sizeof(img->header), 1, img->stream);
-  if (ferror(img->stream))
+  if (pwrite(fd, get_padding(img->header.page_size), len, offset) != (ssize_t)len)
     abort_perror(img->fname);
+}
 
-  fwrite(padding, psize - sizeof(img->header), 1, img->stream);
-  if (ferror(img->stream))
-    abort_perror(img->fname);
 
-  if (img->kernel) {
-    printf ("   kernel %u at 0x%08x\n", img->header.kernel_size, psize);
+// gathered section writer: payload buffers (and the shared zero page,
+// on block devices) are chained into an iovec array and flushed with
+// one pwritev per contiguous region, instead of a stdio write per
+// payload and per padding run
 
-    fwrite(img->kernel, img->header.kernel_size, 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
+#define MAX_IOV 64
 
-    fwrite(padding, psize - (img->header.kernel_size % psize), 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
-  }
+typedef struct
+{
+  t_abootimg*  img;
+  struct iovec iov[MAX_IOV];
+  int          cnt;
+  unsigned     offset;  /* file offset of the first pending byte */
+  unsigned     len;     /* pending bytes */
+} t_vec_writer;
 
-  if (img->ramdisk) {
-    printf ("   ramdisk %u at 0x%08x\n", img->header.ramdisk_size, (1+n)*psize);
 
-    if (fseek(img->stream, (1+n)*psize, SEEK_SET))
-      abort_perror(img->fname);
+void vec_begin(t_vec_writer* w, t_abootimg* img, unsigned offset)
+{
+  w->img = img;
+  w->offset = offset;
+  w->cnt = 0;
+  w->len = 0;
+}
 
-    fwrite(img->ramdisk, img->header.ramdisk_size, 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
 
-    fwrite(padding, psize - (img->header.ramdisk_size % psize), 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
+void vec_flush(t_vec_writer* w)
+{
+  int fd = fileno(w->img->stream);
+  struct iovec* iov = w->iov;
+  int cnt = w->cnt;
+  unsigned off = w->offset;
+
+  while (cnt) {
+    ssize_t wr = pwritev(fd, iov, cnt, off);
+    if (wr < 0)
+      abort_perror(w->img->fname);
+    off += wr;
+    while (cnt && ((size_t)wr >= iov->iov_len)) {
+      wr -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt && wr) {
+      iov->iov_base = (char*)iov->iov_base + wr;
+      iov->iov_len -= wr;
+    }
   }
 
-  if (img->header.second_size) {
-    printf ("   second %u at 0x%08x\n", img->header.second_size, (1+n+m)*psize);
+  w->offset += w->len;
+  w->cnt = 0;
+  w->len = 0;
+}
 
-    if (fseek(img->stream, (1+n+m)*psize, SEEK_SET))
-      abort_perror(img->fname);
 
-    fwrite(img->second, img->header.second_size, 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
+void vec_push(t_vec_writer* w, void* data, unsigned len)
+{
+  if (!len)
+    return;
+  if (w->cnt == MAX_IOV)
+    vec_flush(w);
+  w->iov[w->cnt].iov_base = data;
+  w->iov[w->cnt].iov_len = len;
+  w->cnt++;
+  w->len += len;
+}
+
+
+// position the chain: contiguous pushes keep gathering, a gap flushes
+void vec_seek(t_vec_writer* w, unsigned offset)
+{
+  if (w->offset + w->len == offset)
+    return;
+  vec_flush(w);
+  w->offset = offset;
+}
+
+
+// close a section ending at 'end': the zero padding to the page
+// boundary rides along in the iovec chain on block devices and becomes
+// a hole on regular files
+void vec_pad(t_vec_writer* w, unsigned end, unsigned psize)
+{
+  unsigned pad = psize - (end % psize);
+  if (pad == psize)
+    return;
+  if (w->img->is_blkdev)
+    vec_push(w, get_padding(psize), pad);
+  else
+    write_padding(w->img, end, pad);
+}
+
 
-    fwrite(padding, psize - (img->header.second_size % psize), 1, img->stream);
+// copy a payload file into the image through a bounded buffer, so peak
+// memory stays at stream_bufsz whatever the payload size; the chunks
+// are fed to the digest on the way through when ctx is given
+void stream_payload(t_abootimg* img, char* src_fname, unsigned size, sha1_ctx* ctx)
+{
+  FILE* src = fopen(src_fname, "r");
+  if (!src)
+    abort_perror(src_fname);
+
+  char* buf = malloc(img->stream_bufsz);
+  if (!buf)
+    abort_perror(NULL);
+
+  unsigned left = size;
+  while (left) {
+    unsigned chunk = (left < img->stream_bufsz) ? left : img->stream_bufsz;
+    if ((fread(buf, chunk, 1, src) != 1) || ferror(src))
+      abort_perror(src_fname);
+    if (ctx)
+      sha1_update(ctx, buf, chunk);
+    fwrite(buf, chunk, 1, img->stream);
     if (ferror(img->stream))
       abort_perror(img->fname);
+    left -= chunk;
   }
 
-  // write dtbs to stream
-  if (img->dtbh) {
-    printf ("   dtbs %u at 0x%08x\n", img->header.dtbs_size, (1+n+m+o)*psize);
+  free(buf);
+  fclose(src);
+}
 
-    // go to at beginig of DTBH
-    if (fseek(img->stream, (1+n+m+o)*psize, SEEK_SET))
-      abort_perror(img->fname);
 
-    // write DTBH
-    fwrite(img->dtbh, psize, 1, img->stream);
-    if (ferror(img->stream))
-      abort_perror(img->fname);
-
-    // populate dtbs table
-    dtbs_t *dtbh = (dtbs_t *)img->dtbh;
-
-    // entryes
-    dt_entry_t *dt = (dt_entry_t *)(((char*)img->dtbh) + sizeof(dtbs_t));
-
-    int ientry;
-    for (ientry = 0; ientry<dtbh->num_entries; ientry++) {
-
-      // wtire dtb to stream
-      fwrite(img->dtbs[ientry], dt[ientry].dtb_size, 1, img->stream);
-      if (ferror(img->stream))
-        abort_perror(img->fname);
-
-      if ((dt[ientry].dtb_size % psize) > 0) {
-        printf ("   . dtb padding for %u is %u because %u\n", dt[ientry].dtb_size, psize - (dt[ientry].dtb_size % psize), dt[ientry].dtb_size % psize);
-        fwrite(padding, psize - (dt[ientry].dtb_size % psize), 1, img->stream);
-      };
-
-      if (ferror(img->stream))
-        abort_perror(img->fname);
-    };
+// feed a section that is not being rewritten (it already sits in the
+// image) into the digest, from the mapping when available
+void hash_image_section(t_abootimg* img, sha1_ctx* ctx, unsigned offset, unsigned size)
+{
+  if (!size)
+    return;
 
+  // the mapping covers the image as it was opened; sections pushed past
+  // that (the file grew during this update) are read back with pread
+  if (img->map && (offset + size <= img->map_size)) {
+    sha1_update(ctx, img->map + offset, size);
+    return;
   }
 
+  char buf[64*1024];
+  unsigned left = size;
+  while (left) {
+    unsigned chunk = (left < sizeof(buf)) ? left : sizeof(buf);
+    if (pread(fileno(img->stream), buf, chunk, offset) != (ssize_t)chunk)
+      abort_perror(img->fname);
+    sha1_update(ctx, buf, chunk);
+    offset += chunk;
+    left -= chunk;
+  }
+}
 
-  // update signature
-  printf ("   signature %zu at 0x%08x\n", sizeof(img->signature), (1+n+m+o+p)*psize);
-  // write signature
-  if (fseek(img->stream, (1+n+m+o+p)*psize, SEEK_SET))
-    abort_perror(img->fname);
 
-  fwrite(img->signature, sizeof(img->signature), 1, img->stream);
-  if (ferror(img->stream))
-    abort_perror(img->fname);
+// does the target already hold exactly these bytes? compared by
+// checksum, so a --resume pass costs sequential reads but no writes
+// for the sections an interrupted flash already put in place. a target
+// too short to cover the section simply is not flashed yet
+int section_flashed(t_abootimg* img, char* data, unsigned size, unsigned offset)
+{
+  if (!size)
+    return 1;
 
-  fwrite(padding, psize - (sizeof(img->signature) % psize), 1, img->stream);
-  if (ferror(img->stream))
-    abort_perror(img->fname);
+  sha1_ctx ctx;
+  unsigned char disk[SHA1_DIGEST_SIZE];
+  unsigned char mem[SHA1_DIGEST_SIZE];
 
+  sha1_init(&ctx);
+  if (img->map && (offset + size <= img->map_size))
+    sha1_update(&ctx, img->map + offset, size);
+  else {
+    char buf[64*1024];
+    unsigned left = size;
+    unsigned off = offset;
+    fflush(img->stream);
+    while (left) {
+      unsigned chunk = (left < sizeof(buf)) ? left : sizeof(buf);
+      if (pread(fileno(img->stream), buf, chunk, off) != (ssize_t)chunk)
+        return 0;
+      sha1_update(&ctx, buf, chunk);
+      off += chunk;
+      left -= chunk;
+    }
+  }
+  sha1_final(&ctx, disk);
 
-  //ftruncate (fileno(img->stream), img->size);
+  sha1_init(&ctx);
+  sha1_update(&ctx, data, size);
+  sha1_final(&ctx, mem);
 
-  free(padding);
+  return !memcmp(disk, mem, sizeof(disk));
 }
 
 
-
-void print_bootimg_info(t_abootimg* img)
+// relocate a section inside the image without materializing it:
+// copy_file_range lets the kernel move the bytes; overlapping ranges
+// (small shifts of big sections) fall back to a bounce buffer walked in
+// the direction that never overwrites unread source bytes
+void copy_section_within(t_abootimg* img, unsigned from, unsigned to, unsigned size)
 {
-  printf ("\nAndroid Boot Image Info:\n\n");
-
-  printf ("* file name = %s %s\n\n", img->fname, img->is_blkdev ? "[block device]":"");
+  int fd = fileno(img->stream);
 
-  printf ("* image size = %u bytes (%.2f MB)\n", img->size, (double)img->size/0x100000);
-  //printf ("  page size  = %u bytes\n\n", img->header.page_size);
+  fflush(img->stream);
 
-  printf ("\n<boot_img_hdr>\n");
+#ifdef __linux__
+  if ((from + size <= to) || (to + size <= from)) {
+    off_t off_in = from;
+    off_t off_out = to;
+    unsigned left = size;
+    ssize_t cb = copy_file_range(fd, &off_in, fd, &off_out, left, 0);
+    if (cb >= 0) {
+      left -= cb;
+      while (left) {
+        cb = copy_file_range(fd, &off_in, fd, &off_out, left, 0);
+        if (cb <= 0)
+          abort_perror(img->fname);
+        left -= cb;
+      }
+      return;
+    }
+    // not supported here, fall through to the bounce buffer
+  }
+#endif
 
-  unsigned kernel_size = img->header.kernel_size;
-  unsigned ramdisk_size = img->header.ramdisk_size;
-  unsigned second_size = img->header.second_size;
+  unsigned bufsz = 1024*1024;
+  if (bufsz > size)
+    bufsz = size;
+  char* buf = malloc(bufsz);
+  if (!buf)
+    abort_perror(NULL);
 
-  unsigned page_size  = img->header.page_size;
+  unsigned left = size;
+  while (left) {
+    unsigned chunk = (left < bufsz) ? left : bufsz;
+    unsigned pos = (to > from) ? left - chunk : size - left;
 
-  unsigned dts_size = img->header.dtbs_size;
+    if (pread(fd, buf, chunk, from + pos) != (ssize_t)chunk)
+      abort_perror(img->fname);
+    if (pwrite(fd, buf, chunk, to + pos) != (ssize_t)chunk)
+      abort_perror(img->fname);
+    left -= chunk;
+  }
 
-  // pages
-  unsigned n_pages = (kernel_size + page_size-1) / page_size;
-  unsigned m_pages = (ramdisk_size + page_size-1) / page_size;
-  unsigned o_pages = (second_size + page_size-1) / page_size;
-  unsigned p_pages = (dts_size + page_size-1) / page_size;
+  free(buf);
+}
 
 
-  //printf ("   magic:        %s\n", img->header.magic);
+// materialize one dtb into a flat dtbs blob: from memory when it was
+// (re)loaded, else from the bytes it already holds in the image
+void fetch_dtb(t_abootimg* img, int ientry, dt_entry_t* dt, char* buf, unsigned doffset)
+{
+  // deduped entries share an earlier entry's offset; only the first
+  // one materializes the bytes into the blob
+  int jentry;
+  for (jentry = 0; jentry < ientry; jentry++)
+    if (dt[jentry].offset == dt[ientry].offset)
+      return;
+
+  if (img->dtbs[ientry]) {
+    memcpy(buf + dt[ientry].offset, img->dtbs[ientry], dt[ientry].dtb_size);
+    return;
+  }
 
-  printf ("   kernel_size:  %u bytes (%.2f MB), %u pages\n", kernel_size, (double)kernel_size/0x100000, n_pages);
-  printf ("   kernel_addr:  0x%08x\n", img->header.kernel_addr); /* physical load addr */
+  unsigned src = (img->dtb_from && img->dtb_from[ientry])
+                 ? img->dtb_from[ientry]
+                 : doffset + dt[ientry].offset;
+  if (pread(fileno(img->stream), buf + dt[ientry].offset,
+            dt[ientry].dtb_size, src) != (ssize_t)dt[ientry].dtb_size)
+    abort_perror(img->fname);
+}
 
-  printf ("   ramdisk_size: %u bytes (%.2f MB), %u pages\n", ramdisk_size, (double)ramdisk_size/0x100000, m_pages);
-  printf ("   ramdisk_addr: 0x%08x\n", img->header.ramdisk_addr); /* physical load addr */
 
-  printf ("   second_size:  %u bytes (%.2f MB), %u pages\n", second_size, (double)second_size/0x100000, o_pages);
-  printf ("   second_addr:  0x%08x\n", img->header.second_addr); /* physical load addr */
+/* pluggable signing stage: once the id[] digest is known it is handed
+ * to a signer picked by environment --
+ *
+ *   ABOOTIMG_SIGNKEY=<file>  built-in HMAC-SHA1 over the digest with
+ *                            the key file's bytes, stored as
+ *                            "ABSIGN01" + mac in the signature block
+ *   ABOOTIMG_SIGNER=<cmd>    external agent: <cmd> <hex digest> is run
+ *                            and whatever it prints on stdout becomes
+ *                            the signature block
+ *
+ * the signer runs on its own thread, so an agent round trip overlaps
+ * the payload writes still draining to the target. without either
+ * variable the stage is inert and the SEANDROIDENFORCE stamp from
+ * update_images goes out unchanged. */
 
-  printf ("   tags_addr:    0x%08x\n", img->header.tags_addr); /* physical addr for kernel tags */
-  printf ("   page_size:    %u bytes\n", img->header.page_size); /* flash page size we assume */
+typedef struct
+{
+  t_abootimg* img;
+  pthread_t   thread;
+  int         running;
+} t_signer;
 
-  printf ("   dtbs_size:    %u bytes (%.2f MB), %u pages\n", dts_size, (double)dts_size/0x100000, p_pages);
 
-  printf ("   unused[0]:    %u \n", img->header.unused[0]); /* future expansion: should be 0 */
+void* signer_worker(void* arg)
+{
+  t_signer* s = arg;
+  t_abootimg* img = s->img;
+  unsigned char* digest = (unsigned char*)img->header.id;
+
+  char* keyf = getenv("ABOOTIMG_SIGNKEY");
+  if (keyf) {
+    FILE* f = fopen(keyf, "r");
+    if (!f)
+      abort_perror(keyf);
+    char key[256];
+    size_t klen = fread(key, 1, sizeof(key), f);
+    if (ferror(f))
+      abort_perror(keyf);
+    fclose(f);
+
+    unsigned char mac[SHA1_DIGEST_SIZE];
+    hmac_sha1(key, klen, digest, SHA1_DIGEST_SIZE, mac);
+
+    memset(img->signature, 0, sizeof(img->signature));
+    memcpy(img->signature, "ABSIGN01", 8);
+    memcpy(img->signature + 8, mac, sizeof(mac));
+    return NULL;
+  }
 
-  printf ("   name:         %s\n\n", img->header.name);
+  char* signer = getenv("ABOOTIMG_SIGNER");
+  char hex[2*SHA1_DIGEST_SIZE + 1];
+  int i;
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    sprintf(hex + 2*i, "%02x", digest[i]);
 
-  //printf ("   cmdline: %s\n");
-  if (img->header.cmdline[0])
-    printf ("   cmdline:      %s\n\n", img->header.cmdline);
-  else
-    printf ("   cmdline       empty\n\n");
+  char cmd[1024];
+  snprintf(cmd, sizeof(cmd), "%s %s", signer, hex);
 
-  printf ("   id[8] 0x%04X%04X%04X%04X%04X%04X%04X%04X\n",
-    img->header.id[0],img->header.id[1],img->header.id[2],img->header.id[3],
-    img->header.id[4],img->header.id[5],img->header.id[6],img->header.id[7]
-  ); /* timestamp / checksum / sha1 / etc */
+  FILE* pf = popen(cmd, "r");
+  if (!pf)
+    abort_perror(signer);
 
-  printf ("\n<boot_img layout>\n");
+  memset(img->signature, 0, sizeof(img->signature));
+  size_t got = fread(img->signature, 1, sizeof(img->signature), pf);
+  if (pclose(pf))
+    abort_printf("%s: signer failed\n", signer);
+  if (!got)
+    abort_printf("%s: signer wrote no signature\n", signer);
 
-  unsigned offset = ((sizeof(img->header) + page_size-1) / page_size); // initial offset of header, one page is more than enough
+  return NULL;
+}
 
-  unsigned kernel_offset = offset * page_size; offset += n_pages;
-  unsigned ramdisk_offset = offset * page_size; offset += m_pages;
-  unsigned second_offset = offset * page_size; offset += o_pages;
-  unsigned dts_offset = offset * page_size; offset += p_pages; // for the signature
-  unsigned signature_offset = offset * page_size;
 
-  printf ("   kernel offset     0x%08x\n", kernel_offset);
-  printf ("   ramdisk offset:   0x%08x\n", ramdisk_offset);
-  printf ("   secondary offset: 0x%08x\n", second_offset);
-  printf ("   dtbs offset:      0x%08x\n", dts_offset);
-  printf ("   signature offset: 0x%08x\n", signature_offset);
+// call with the digest finalized in header.id; a configured signer
+// forces the signature block out even on a header-only update
+void signer_start(t_signer* s, t_abootimg* img)
+{
+  s->running = (getenv("ABOOTIMG_SIGNKEY") || getenv("ABOOTIMG_SIGNER"));
+  if (!s->running)
+    return;
 
-  printf ("\n");
+  s->img = img;
+  img->dirty_signature = 1;
+  if (pthread_create(&s->thread, NULL, signer_worker, s))
+    abort_perror("pthread_create");
 }
 
 
-void print_dtbh_info(t_abootimg* img)
+void signer_join(t_signer* s)
 {
-  unsigned page_size = img->header.page_size;
+  if (!s->running)
+    return;
+  if (pthread_join(s->thread, NULL))
+    abort_perror("pthread_join");
+  s->running = 0;
+}
 
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
-  unsigned ssize = img->header.second_size;
-  unsigned dsize = img->header.dtbs_size;
 
-  unsigned n = (ksize + page_size - 1) / page_size;
-  unsigned m = (rsize + page_size - 1) / page_size;
-  unsigned o = (ssize + page_size - 1) / page_size;
-  //unsigned p = (dsize + page_size - 1) / page_size;
+#define MAX_AIO_SECTIONS 8
 
-  //unsigned roffset = (1+n)*page_size;
-  //unsigned soffset = (1+n+m)*page_size;
-  unsigned doffset = (1+n+m+o)*page_size;
+// async flash path for block devices: payload sections are queued as
+// page-aligned O_DIRECT writes so they sit in the device queue
+// simultaneously instead of trickling through stdio. The header is
+// committed last, once every payload write has landed.
+void write_bootimg_async(t_abootimg* img)
+{
+  unsigned psize = img->header.page_size;
 
-  //printf (" copy  dtbs %u bytes from 0x%08x\n", dsize, doffset);
+  printf ("Writing Boot Image %s [async]\n", img->fname);
 
-  char* d = malloc(dsize);
-  if (!d)
-    abort_perror("");
-  if (fseek(img->stream, doffset, SEEK_SET))
-    abort_perror(img->fname);
-  size_t rb = fread(d, dsize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
-  else if (feof(img->stream))
-    abort_printf("%s: cannot read dtbs\n", img->fname);
+  int fd = open(img->fname, O_WRONLY|O_DIRECT);
+  int direct = 1;
+  if (fd == -1) {
+    // device (or kernel) without O_DIRECT support, queue plain writes
+    fd = open(img->fname, O_WRONLY);
+    direct = 0;
+    if (fd == -1)
+      abort_perror(img->fname);
+  }
 
-  dtbs_t *dtbh = (dtbs_t *)d;
+  t_layout* l = &img->layout;
 
-  printf ("\n<dtbh_header Info>\n");
-  printf ("  magic:0x%08x, version:0x%08x, num_entries:0x%08x\n",
-    dtbh->magic, dtbh->version, dtbh->num_entries);
+  struct aiocb cbs[MAX_AIO_SECTIONS];
+  const struct aiocb* cbl[MAX_AIO_SECTIONS];
+  int ncb = 0;
 
-/*
-  printf ("\n<device info>\n");
-  printf ("        chip_id: 0x%08x\n", dtbh->device_info.chip_id);
-  printf ("    platform_id: 0x%08x\n", dtbh->device_info.platform_id);
-  printf ("     subtype_id: 0x%08x\n", dtbh->device_info.subtype_id);
-  printf ("         hw_rev: 0x%08x\n", dtbh->device_info.hw_rev);
-*/
+  memset(cbs, 0, sizeof(cbs));
 
-  dt_entry_t *dt = (dt_entry_t *)(d + sizeof(dtbs_t));
-  int ientry;
-  for (ientry = 0; ientry<dtbh->num_entries; ientry++) {
-    printf ("\ndt_entry[%02d]\n", ientry);
-    printf ("        chip_id: 0x%08x\n", dt[ientry].chip_id);
-    printf ("    platform_id: 0x%08x\n", dt[ientry].platform_id);
-    printf ("     subtype_id: 0x%08x\n", dt[ientry].subtype_id);
-    printf ("         hw_rev: 0x%08x\n", dt[ientry].hw_rev);
-    printf ("     hw_rev_end: 0x%08x\n", dt[ientry].hw_rev_end);
-    printf ("         offset: 0x%08x\n", dt[ientry].offset);
-    printf ("       dtb size: 0x%08x\n", dt[ientry].dtb_size);
-  }
+  sha1_ctx ctx;
+  sha1_init(&ctx);
 
-  printf ("\n");
-}
+  struct { char* data; unsigned size; unsigned offset; char* name; } secs[4];
+  int nsec = 0;
 
+  secs[nsec].data = img->kernel;
+  secs[nsec].size = img->header.kernel_size;
+  secs[nsec].offset = l->kernel_offset;
+  secs[nsec++].name = "kernel";
 
+  secs[nsec].data = img->ramdisk;
+  secs[nsec].size = img->header.ramdisk_size;
+  secs[nsec].offset = l->ramdisk_offset;
+  secs[nsec++].name = "ramdisk";
 
-void write_bootimg_config(t_abootimg* img)
-{
-  printf ("writing boot image config in %s\n", img->config_fname);
+  if (img->second) {
+    secs[nsec].data = img->second;
+    secs[nsec].size = img->header.second_size;
+    secs[nsec].offset = l->second_offset;
+    secs[nsec++].name = "second";
+  }
 
-  FILE* config_file = fopen(img->config_fname, "w");
-  if (!config_file)
-    abort_perror(img->config_fname);
+  int i;
+  for (i=0; i<nsec; i++) {
+    unsigned padded = layout_roundup(l, secs[i].size);
 
-  fprintf(config_file, "bootsize = 0x%x\n", img->size);
-  fprintf(config_file, "pagesize = 0x%x\n", img->header.page_size);
+    printf ("   %s %u at 0x%08x\n", secs[i].name, secs[i].size, secs[i].offset);
 
-  fprintf(config_file, "kerneladdr = 0x%x\n", img->header.kernel_addr);
-  fprintf(config_file, "ramdiskaddr = 0x%x\n", img->header.ramdisk_addr);
-  fprintf(config_file, "secondaddr = 0x%x\n", img->header.second_addr);
-  fprintf(config_file, "tagsaddr = 0x%x\n", img->header.tags_addr);
+    if (img->flash_resume
+        && section_flashed(img, secs[i].data, secs[i].size, secs[i].offset)) {
+      printf ("   . already flashed, skipped\n");
+      continue;
+    }
 
-  fprintf(config_file, "name = %s\n", img->header.name);
-  fprintf(config_file, "cmdline = %s\n", img->header.cmdline);
-  
-  fclose(config_file);
-}
+    char* buf;
+    if (posix_memalign((void**)&buf, 4096, padded))
+      abort_perror(NULL);
+    memcpy(buf, secs[i].data, secs[i].size);
+    memset(buf + secs[i].size, 0, padded - secs[i].size);
+
+    cbs[ncb].aio_fildes = fd;
+    cbs[ncb].aio_buf = buf;
+    cbs[ncb].aio_nbytes = padded;
+    cbs[ncb].aio_offset = secs[i].offset;
+    if (aio_write(&cbs[ncb]))
+      abort_perror(img->fname);
+    cbl[ncb] = &cbs[ncb];
+    ncb++;
+  }
 
+  // the id[] chain (see write_bootimg) overlaps with the in-flight writes
+  sha1_update(&ctx, img->kernel, img->header.kernel_size);
+  sha1_update(&ctx, &img->header.kernel_size, sizeof(img->header.kernel_size));
+  sha1_update(&ctx, img->ramdisk, img->header.ramdisk_size);
+  sha1_update(&ctx, &img->header.ramdisk_size, sizeof(img->header.ramdisk_size));
+  if (img->second)
+    sha1_update(&ctx, img->second, img->header.second_size);
+  else
+    // a second stage left untouched on the device still belongs in the
+    // id[] chain, like the sync and delta writers hash it
+    hash_image_section(img, &ctx, l->second_offset, img->header.second_size);
+  sha1_update(&ctx, &img->header.second_size, sizeof(img->header.second_size));
 
+  // dtbs: dtbh page plus each dtb laid out page-aligned, as one write
+  if (img->dtbh) {
+    printf ("   dtbs %u at 0x%08x\n", img->header.dtbs_size, l->dtbs_offset);
 
-void extract_kernel(t_abootimg* img)
-{
-  unsigned psize = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
+    unsigned padded = l->sig_offset - l->dtbs_offset;
+    char* buf;
+    if (posix_memalign((void**)&buf, 4096, padded))
+      abort_perror(NULL);
+    memset(buf, 0, padded);
+    memcpy(buf, img->dtbh, psize);
 
-  printf ("extracting kernel in %s\n", img->kernel_fname);
+    dtbs_t* dtbh = (dtbs_t*)img->dtbh;
+    dt_entry_t* dt = (dt_entry_t*)(((char*)img->dtbh) + sizeof(dtbs_t));
+    int ientry;
+    for (ientry = 0; ientry<dtbh->num_entries; ientry++)
+      fetch_dtb(img, ientry, dt, buf, l->dtbs_offset);
 
-  void* k = malloc(ksize);
-  if (!k)
-    abort_perror(NULL);
+    if (img->flash_resume
+        && section_flashed(img, buf, padded, l->dtbs_offset)) {
+      printf ("   . already flashed, skipped\n");
+      free(buf);
+    }
+    else {
+      cbs[ncb].aio_fildes = fd;
+      cbs[ncb].aio_buf = buf;
+      cbs[ncb].aio_nbytes = padded;
+      cbs[ncb].aio_offset = l->dtbs_offset;
+      if (aio_write(&cbs[ncb]))
+        abort_perror(img->fname);
+      cbl[ncb] = &cbs[ncb];
+      ncb++;
+    }
+  }
 
-  if (fseek(img->stream, psize, SEEK_SET))
-    abort_perror(img->fname);
+  // the digest is complete; a configured signer works on it while the
+  // queued payload writes drain
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  sha1_final(&ctx, digest);
+  memset(img->header.id, 0, sizeof(img->header.id));
+  memcpy(img->header.id, digest, SHA1_DIGEST_SIZE);
 
-  size_t rb = fread(k, ksize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
- 
-  FILE* kernel_file = fopen(img->kernel_fname, "w");
-  if (!kernel_file)
-    abort_perror(img->kernel_fname);
+  t_signer sg;
+  signer_start(&sg, img);
 
-  fwrite(k, ksize, 1, kernel_file);
-  if (ferror(kernel_file))
-    abort_perror(img->kernel_fname);
+  // drain the queue and check every write landed in full
+  int left = ncb;
+  while (left) {
+    if (aio_suspend(cbl, ncb, NULL))
+      abort_perror(img->fname);
+    left = 0;
+    for (i=0; i<ncb; i++) {
+      int err = aio_error(&cbs[i]);
+      if (err == EINPROGRESS)
+        left++;
+      else if (err) {
+        errno = err;
+        abort_perror(img->fname);
+      }
+      else if (cbs[i].aio_buf && (size_t)aio_return(&cbs[i]) != cbs[i].aio_nbytes)
+        abort_printf("%s: short write", img->fname);
+      else {
+        free((void*)cbs[i].aio_buf);
+        cbs[i].aio_buf = NULL;
+      }
+    }
+  }
 
-  fclose(kernel_file);
-  free(k);
-}
+  signer_join(&sg);
 
+  // signature page, once the signer (if any) filled it in
+  if (img->dirty_signature) {
+    printf ("   signature %zu at 0x%08x\n", sizeof(img->signature), l->sig_offset);
 
-void extract_ramdisk(t_abootimg* img)
-{
-  unsigned psize = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
+    char* buf;
+    if (posix_memalign((void**)&buf, 4096, psize))
+      abort_perror(NULL);
+    memset(buf, 0, psize);
+    memcpy(buf, img->signature, sizeof(img->signature));
+
+    if (pwrite(fd, buf, psize, l->sig_offset) != (ssize_t)psize)
+      abort_perror(img->fname);
+    free(buf);
+  }
 
-  unsigned n = (ksize + psize - 1) / psize;
-  unsigned roffset = (1+n)*psize;
+  if (fsync(fd))
+    abort_perror(img->fname);
 
-  printf ("extracting ramdisk in %s\n", img->ramdisk_fname);
+  // header last: a torn flash never presents a valid magic
+  printf ("   header %zu\n", sizeof(img->header));
 
-  void* r = malloc(rsize);
-  if (!r) 
+  char* hbuf;
+  if (posix_memalign((void**)&hbuf, 4096, psize))
     abort_perror(NULL);
+  memset(hbuf, 0, psize);
+  memcpy(hbuf, &img->header, sizeof(img->header));
 
-  if (fseek(img->stream, roffset, SEEK_SET))
+  if (pwrite(fd, hbuf, psize, 0) != (ssize_t)psize)
     abort_perror(img->fname);
-
-  size_t rb = fread(r, rsize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
+  if (fsync(fd))
     abort_perror(img->fname);
- 
-  FILE* ramdisk_file = fopen(img->ramdisk_fname, "w");
-  if (!ramdisk_file)
-    abort_perror(img->ramdisk_fname);
 
-  fwrite(r, rsize, 1, ramdisk_file);
-  if (ferror(ramdisk_file))
-    abort_perror(img->ramdisk_fname);
+  free(hbuf);
+  close(fd);
 
-  fclose(ramdisk_file);
-  free(r);
+  (void)direct;
 }
 
 
-void extract_second(t_abootimg* img)
+// compare one section page by page against what the target already
+// holds and rewrite only the pages that differ; the old bytes come from
+// the image mapping when it covers them, else a pread bounce page.
+// the tail of the last page is compared as zeroes, like the padding
+// the full writer emits.
+void delta_section(t_abootimg* img, const char* data, unsigned size,
+                   unsigned offset, unsigned* scanned, unsigned* written)
 {
   unsigned psize = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
-  unsigned ssize = img->header.second_size;
-
-  if (!ssize) // Second Stage not present
-    return;
+  int fd = fileno(img->stream);
+  unsigned padded = layout_roundup(&img->layout, size);
+
+  char* page = arena_alloc(img, 2*psize);
+  char* old_page = page + psize;
+
+  unsigned pos;
+  for (pos = 0; pos < padded; pos += psize) {
+    const char* new = data + pos;
+    if (pos + psize > size) {
+      unsigned tail = size - pos;
+      memcpy(page, data + pos, tail);
+      memset(page + tail, 0, psize - tail);
+      new = page;
+    }
 
-  unsigned n = (rsize + ksize + psize - 1) / psize;
-  unsigned soffset = (1+n)*psize;
+    const char* old = NULL;
+    if (img->map && (offset + pos + psize <= img->map_size))
+      old = img->map + offset + pos;
+    else if (pread(fd, old_page, psize, offset + pos) == (ssize_t)psize)
+      old = old_page;
 
-  printf ("extracting second stage image in %s\n", img->second_fname);
+    (*scanned)++;
+    if (old && !memcmp(old, new, psize))
+      continue;
 
-  void* s = malloc(ssize);
-  if (!s)
-    abort_perror(NULL);
+    if (pwrite(fd, new, psize, offset + pos) != (ssize_t)psize)
+      abort_perror(img->fname);
+    (*written)++;
+  }
+}
 
-  if (fseek(img->stream, soffset, SEEK_SET))
-    abort_perror(img->fname);
 
-  size_t rb = fread(s, ssize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
- 
-  FILE* second_file = fopen(img->second_fname, "w");
-  if (!second_file)
-    abort_perror(img->second_fname);
+// delta flash (--flash-delta): every section is diffed against the
+// previous image already sitting on the target and only the changed
+// pages are rewritten. On the typical kernel-debug loop almost all
+// pages are identical, so a reflash costs a sequential read plus a
+// couple of writes. The header still goes last.
+void write_bootimg_delta(t_abootimg* img)
+{
+  unsigned psize = img->header.page_size;
 
-  fwrite(s, ssize, 1, second_file);
-  if (ferror(second_file))
-    abort_perror(img->second_fname);
+  printf ("Writing Boot Image %s [delta]\n", img->fname);
 
-  fclose(second_file);
-  free(s);
-}
+  t_layout* l = &img->layout;
 
+  unsigned scanned = 0;
+  unsigned written = 0;
 
-void extract_dtbs(t_abootimg* img)
-{
-  unsigned psize = img->header.page_size;
-  unsigned ksize = img->header.kernel_size;
-  unsigned rsize = img->header.ramdisk_size;
-  unsigned ssize = img->header.second_size;
-  unsigned dsize = img->header.dtbs_size;
+  int rehash = img->kernel || img->ramdisk || img->second;
+  sha1_ctx ctx;
+  sha1_init(&ctx);
 
-  unsigned n = (ksize + rsize + ssize + psize-1) / psize;
-  unsigned doffset = (1+n)*psize;
+  fflush(img->stream);
 
-  printf ("extracting ");
+  if (img->kernel) {
+    delta_section(img, img->kernel, img->header.kernel_size, l->kernel_offset,
+                  &scanned, &written);
+    sha1_update(&ctx, img->kernel, img->header.kernel_size);
+  }
+  else if (rehash)
+    hash_image_section(img, &ctx, l->kernel_offset, img->header.kernel_size);
 
-  void* d = malloc(dsize);
-  if (!d)
-    abort_perror(NULL);
+  if (rehash)
+    sha1_update(&ctx, &img->header.kernel_size, sizeof(img->header.kernel_size));
 
-  if (fseek(img->stream, doffset, SEEK_SET))
-    abort_perror(img->fname);
+  if (img->ramdisk) {
+    delta_section(img, img->ramdisk, img->header.ramdisk_size, l->ramdisk_offset,
+                  &scanned, &written);
+    sha1_update(&ctx, img->ramdisk, img->header.ramdisk_size);
+  }
+  else if (rehash)
+    hash_image_section(img, &ctx, l->ramdisk_offset, img->header.ramdisk_size);
 
-  size_t rb = fread(d, dsize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
+  if (rehash)
+    sha1_update(&ctx, &img->header.ramdisk_size, sizeof(img->header.ramdisk_size));
 
-  char dtbname[256] = {0};
+  if (img->second) {
+    delta_section(img, img->second, img->header.second_size, l->second_offset,
+                  &scanned, &written);
+    sha1_update(&ctx, img->second, img->header.second_size);
+  }
+  else if (rehash)
+    hash_image_section(img, &ctx, l->second_offset, img->header.second_size);
 
-  sprintf(dtbname,"%s.dtbh",img->dtbs_fname);
+  if (rehash)
+    sha1_update(&ctx, &img->header.second_size, sizeof(img->header.second_size));
 
-  printf ("DTBH %s\n", dtbname);
+  // dtbs are laid out into one padded buffer, then diffed as a section
+  if (img->dtbh) {
+    unsigned dpadded = l->sig_offset - l->dtbs_offset;
+    char* buf = arena_alloc(img, dpadded);
+    memset(buf, 0, dpadded);
+    memcpy(buf, img->dtbh, psize);
 
-  // load header of dtbh
-  dtbs_t *dtbh = (dtbs_t *)d;
+    dtbs_t* dtbh = (dtbs_t*)img->dtbh;
+    dt_entry_t* dt = (dt_entry_t*)(((char*)img->dtbh) + sizeof(dtbs_t));
+    int ientry;
+    for (ientry = 0; ientry<dtbh->num_entries; ientry++)
+      fetch_dtb(img, ientry, dt, buf, l->dtbs_offset);
 
-  FILE* dtbs_file = fopen(dtbname, "w");
-  if (!dtbs_file)
-    abort_perror(dtbname);
+    delta_section(img, buf, dpadded, l->dtbs_offset, &scanned, &written);
+  }
 
-  unsigned dtbhsize = sizeof(dtbs_t) + sizeof(dt_entry_t) * dtbh->num_entries;
-  fwrite(d, dtbhsize, 1, dtbs_file);
-  if (ferror(dtbs_file))
-    abort_perror(dtbname);
+  if (rehash) {
+    unsigned char digest[SHA1_DIGEST_SIZE];
+    sha1_final(&ctx, digest);
+    memset(img->header.id, 0, sizeof(img->header.id));
+    memcpy(img->header.id, digest, SHA1_DIGEST_SIZE);
+  }
 
-  fclose(dtbs_file);
+  // the signer (if any) overlaps the payload barrier below
+  t_signer sg;
+  signer_start(&sg, img);
 
-  dt_entry_t *dt = (dt_entry_t *)(d + sizeof(dtbs_t));
+  // payloads are on the target before the header can point at them
+  if (written && fsync(fileno(img->stream)))
+    abort_perror(img->fname);
 
-  int ientry;
+  signer_join(&sg);
 
-  for (ientry = 0; ientry<dtbh->num_entries; ientry++) {
-    sprintf(dtbname,"%s.dtb_p%d",img->dtbs_fname,ientry);
+  if (img->dirty_signature)
+    delta_section(img, img->signature, sizeof(img->signature),
+                  l->sig_offset, &scanned, &written);
 
-    printf (" .. dtb %s offset 0x%08x, size 0x%08x\n", dtbname, dt[ientry].offset, dt[ientry].dtb_size);
+  delta_section(img, (char*)&img->header, sizeof(img->header), 0,
+                &scanned, &written);
 
-    FILE* dtbs_file = fopen(dtbname, "w");
-    if (!dtbs_file)
-      abort_perror(dtbname);
+  if (written && fsync(fileno(img->stream)))
+    abort_perror(img->fname);
 
-    fwrite((d + dt[ientry].offset), dt[ientry].dtb_size, 1, dtbs_file);
-    if (ferror(dtbs_file))
-      abort_perror(dtbname);
-    fclose(dtbs_file);
-  }
-  free(d);
+  printf ("   %u of %u pages differed\n", written, scanned);
 }
 
 
-void extract_signature(t_abootimg* img)
+void write_bootimg(t_abootimg* img)
 {
-/*  unsigned psize = img->header.page_size;
-  unsigned zsize = 256;
+  unsigned psize;
 
-  printf ("extracting signature in %s\n", img->signature_fname);
+  // delta mode only makes sense while the layout is unchanged: once a
+  // section moved, the old pages are not where the new ones go
+  if (img->flash_delta && !img->stream_bufsz && (img->ramdisk_nparts < 2)
+      && !img->kernel_from
+      && !img->ramdisk_from && !img->second_from && !img->dtbs_from) {
+    write_bootimg_delta(img);
+    save_pending_dtb_cache(img);
+    return;
+  }
+  if (img->flash_delta)
+    printf ("   layout changed, --flash-delta falls back to a full write\n");
+
+  // full flashes of a block device go through the async queued writer;
+  // partial/streamed updates keep the incremental stdio path
+  if (img->is_blkdev && !img->stream_bufsz && img->kernel && img->ramdisk
+      && !img->second_from && !img->dtbs_from) {
+    write_bootimg_async(img);
+    save_pending_dtb_cache(img);
+    return;
+  }
 
-  void* k = malloc(ksize);
-  if (!k)
-    abort_perror(NULL);
+  printf ("Writing Boot Image %s\n", img->fname);
 
-  if (fseek(img->stream, psize, SEEK_SET))
-    abort_perror(img->fname);
+  psize = img->header.page_size;
 
-  size_t rb = fread(k, ksize, 1, img->stream);
-  if ((rb!=1) || ferror(img->stream))
-    abort_perror(img->fname);
+  t_layout* l = &img->layout;
 
-  FILE* kernel_file = fopen(img->kernel_fname, "w");
-  if (!kernel_file)
-    abort_perror(img->kernel_fname);
+  // relocate the lazy sections first: their new offsets are sources for
+  // nothing and their old offsets may be clobbered by the writes below.
+  // moves to higher offsets run back-to-front so no source is
+  // overwritten before it has been read
+  struct { unsigned from; unsigned to; unsigned size; char* name; } lazy[4];
+  int nlazy = 0;
 
-  fwrite(k, ksize, 1, kernel_file);
-  if (ferror(kernel_file))
-    abort_perror(img->kernel_fname);
+  if (img->kernel_from) {
+    lazy[nlazy].from = img->kernel_from;  lazy[nlazy].to = psize;
+    lazy[nlazy].size = img->header.kernel_size;  lazy[nlazy++].name = "kernel";
+  }
+  if (img->ramdisk_from) {
+    lazy[nlazy].from = img->ramdisk_from;  lazy[nlazy].to = l->ramdisk_offset;
+    lazy[nlazy].size = img->header.ramdisk_size;  lazy[nlazy++].name = "ramdisk";
+  }
+  if (img->second_from) {
+    lazy[nlazy].from = img->second_from;  lazy[nlazy].to = l->second_offset;
+    lazy[nlazy].size = img->header.second_size;  lazy[nlazy++].name = "second";
+  }
+  if (img->dtbs_from) {
+    lazy[nlazy].from = img->dtbs_from;  lazy[nlazy].to = l->dtbs_offset;
+    lazy[nlazy].size = img->header.dtbs_size;  lazy[nlazy++].name = "dtbs";
+  }
+
+  if (nlazy) {
+    int up = (lazy[0].to > lazy[0].from);
+    int i;
+    for (i = up ? nlazy-1 : 0; (i >= 0) && (i < nlazy); up ? i-- : i++) {
+      printf ("   move %s %u bytes 0x%08x -> 0x%08x\n",
+              lazy[i].name, lazy[i].size, lazy[i].from, lazy[i].to);
+      copy_section_within(img, lazy[i].from, lazy[i].to, lazy[i].size);
+      if (lazy[i].size % psize)
+        write_padding(img, lazy[i].to + lazy[i].size,
+                      psize - (lazy[i].size % psize));
+    }
+  }
+
+  // mkbootimg fills id[] with SHA1(kernel + kernel_size + ramdisk +
+  // ramdisk_size + second + second_size); compute it while the data
+  // passes through, but only when some payload actually changes
+  // (header-only updates keep the id already stored on disk)
+  int rehash = img->kernel || img->kernel_src || img->ramdisk || img->ramdisk_src
+               || (img->ramdisk_nparts > 1) || img->second || img->second_src;
+  sha1_ctx ctx;
+  sha1_init(&ctx);
+
+  // in-memory payloads are gathered into an iovec chain and flushed
+  // with one pwritev per contiguous region
+  t_vec_writer w;
+  vec_begin(&w, img, 0);
+
+  if (img->kernel || img->kernel_src) {
+    printf ("   kernel %u at 0x%08x\n", img->header.kernel_size, psize);
+
+    if (img->kernel_src) {
+      if (fseek(img->stream, psize, SEEK_SET))
+        abort_perror(img->fname);
+      stream_payload(img, img->kernel_src, img->header.kernel_size, rehash ? &ctx : NULL);
+      if (img->header.kernel_size % psize)
+        write_padding(img, psize + img->header.kernel_size,
+                      psize - (img->header.kernel_size % psize));
+    }
+    else {
+      sha1_update(&ctx, img->kernel, img->header.kernel_size);
+      if (img->flash_resume
+          && section_flashed(img, img->kernel, img->header.kernel_size, psize))
+        printf ("   . already flashed, skipped\n");
+      else {
+        vec_seek(&w, psize);
+        vec_push(&w, img->kernel, img->header.kernel_size);
+        vec_pad(&w, psize + img->header.kernel_size, psize);
+      }
+    }
+  }
+  else if (rehash)
+    hash_image_section(img, &ctx, psize, img->header.kernel_size);
+
+  if (rehash)
+    sha1_update(&ctx, &img->header.kernel_size, sizeof(img->header.kernel_size));
+
+  if (img->ramdisk || img->ramdisk_src || (img->ramdisk_nparts > 1)) {
+    printf ("   ramdisk %u at 0x%08x\n", img->header.ramdisk_size, l->ramdisk_offset);
+
+    if (img->ramdisk_nparts > 1) {
+      // the parts land back-to-back: in-memory parts ride the iovec
+      // chain, streamed parts (-S) go through the bounded buffer
+      unsigned off = l->ramdisk_offset;
+      int ipart;
+      for (ipart = 0; ipart < img->ramdisk_nparts; ipart++) {
+        unsigned psz = img->ramdisk_part_size[ipart];
+        if (img->ramdisk_part_data[ipart]) {
+          sha1_update(&ctx, img->ramdisk_part_data[ipart], psz);
+          vec_seek(&w, off);
+          vec_push(&w, img->ramdisk_part_data[ipart], psz);
+        }
+        else {
+          vec_flush(&w);
+          if (fseek(img->stream, off, SEEK_SET))
+            abort_perror(img->fname);
+          stream_payload(img, img->ramdisk_parts[ipart], psz, rehash ? &ctx : NULL);
+        }
+        off += psz;
+      }
+      vec_seek(&w, off);
+      vec_pad(&w, off, psize);
+    }
+    else if (img->ramdisk_src) {
+      if (fseek(img->stream, l->ramdisk_offset, SEEK_SET))
+        abort_perror(img->fname);
+      stream_payload(img, img->ramdisk_src, img->header.ramdisk_size, rehash ? &ctx : NULL);
+      if (img->header.ramdisk_size % psize)
+        write_padding(img, l->ramdisk_offset + img->header.ramdisk_size,
+                      psize - (img->header.ramdisk_size % psize));
+    }
+    else {
+      sha1_update(&ctx, img->ramdisk, img->header.ramdisk_size);
+      if (img->flash_resume
+          && section_flashed(img, img->ramdisk, img->header.ramdisk_size, l->ramdisk_offset))
+        printf ("   . already flashed, skipped\n");
+      else {
+        vec_seek(&w, l->ramdisk_offset);
+        vec_push(&w, img->ramdisk, img->header.ramdisk_size);
+        vec_pad(&w, l->ramdisk_offset + img->header.ramdisk_size, psize);
+      }
+    }
+  }
+  else if (rehash)
+    hash_image_section(img, &ctx, l->ramdisk_offset, img->header.ramdisk_size);
+
+  if (rehash)
+    sha1_update(&ctx, &img->header.ramdisk_size, sizeof(img->header.ramdisk_size));
+
+  if (img->second || img->second_src) {
+    printf ("   second %u at 0x%08x\n", img->header.second_size, l->second_offset);
+
+    if (img->second_src) {
+      if (fseek(img->stream, l->second_offset, SEEK_SET))
+        abort_perror(img->fname);
+      stream_payload(img, img->second_src, img->header.second_size, rehash ? &ctx : NULL);
+      if (img->header.second_size % psize)
+        write_padding(img, l->second_offset + img->header.second_size,
+                      psize - (img->header.second_size % psize));
+    }
+    else {
+      sha1_update(&ctx, img->second, img->header.second_size);
+      if (img->flash_resume
+          && section_flashed(img, img->second, img->header.second_size, l->second_offset))
+        printf ("   . already flashed, skipped\n");
+      else {
+        vec_seek(&w, l->second_offset);
+        vec_push(&w, img->second, img->header.second_size);
+        vec_pad(&w, l->second_offset + img->header.second_size, psize);
+      }
+    }
+  }
+  else if (rehash)
+    hash_image_section(img, &ctx, l->second_offset, img->header.second_size);
+
+  if (rehash)
+    sha1_update(&ctx, &img->header.second_size, sizeof(img->header.second_size));
+
+  // write dtbs to stream
+  if (img->dtbh) {
+    printf ("   dtbs %u at 0x%08x\n", img->header.dtbs_size, l->dtbs_offset);
+
+    // write DTBH
+    vec_seek(&w, l->dtbs_offset);
+    vec_push(&w, img->dtbh, psize);
+
+    // populate dtbs table
+    dtbs_t *dtbh = (dtbs_t *)img->dtbh;
+
+    // entryes
+    dt_entry_t *dt = (dt_entry_t *)(((char*)img->dtbh) + sizeof(dtbs_t));
+
+    int ientry;
+
+    // cached dtbs that moved inside the section are copied within the
+    // image before anything is written over their old bytes; they all
+    // shift the same way (update_images stages mixed runs through
+    // memory), so upward moves run back-to-front
+    if (img->dtb_from) {
+      int up = 0;
+      int ne = dtbh->num_entries;
+      for (ientry = 0; ientry<ne; ientry++)
+        if (img->dtb_from[ientry]
+            && (l->dtbs_offset + dt[ientry].offset > img->dtb_from[ientry]))
+          up = 1;
+      for (ientry = up ? ne-1 : 0; (ientry >= 0) && (ientry < ne);
+           up ? ientry-- : ientry++) {
+        if (!img->dtb_from[ientry])
+          continue;
+        unsigned to = l->dtbs_offset + dt[ientry].offset;
+        printf ("   move dtb %d %u bytes 0x%08x -> 0x%08x\n",
+                ientry, dt[ientry].dtb_size, img->dtb_from[ientry], to);
+        copy_section_within(img, img->dtb_from[ientry], to, dt[ientry].dtb_size);
+        if (dt[ientry].dtb_size % psize)
+          write_padding(img, to + dt[ientry].dtb_size,
+                        psize - (dt[ientry].dtb_size % psize));
+      }
+    }
+
+    for (ientry = 0; ientry<dtbh->num_entries; ientry++) {
+
+      // cached entries are already in place (or were copied above)
+      if (img->dtb_clean && img->dtb_clean[ientry])
+        continue;
+      if (img->dtb_from && img->dtb_from[ientry])
+        continue;
+      if (img->flash_resume
+          && section_flashed(img, img->dtbs[ientry], dt[ientry].dtb_size,
+                             l->dtbs_offset + dt[ientry].offset))
+        continue;
+
+      // each dtb goes to its table offset; the padding pages between
+      // them become holes on regular files, or ride along in the chain
+      vec_seek(&w, l->dtbs_offset + dt[ientry].offset);
+      vec_push(&w, img->dtbs[ientry], dt[ientry].dtb_size);
+
+      if ((dt[ientry].dtb_size % psize) > 0) {
+        printf ("   . dtb padding for %u is %u because %u\n", dt[ientry].dtb_size, psize - (dt[ientry].dtb_size % psize), dt[ientry].dtb_size % psize);
+        vec_pad(&w, l->dtbs_offset + dt[ientry].offset + dt[ientry].dtb_size, psize);
+      };
+    };
+
+  }
+
+
+  if (rehash) {
+    unsigned char digest[SHA1_DIGEST_SIZE];
+    sha1_final(&ctx, digest);
+    memset(img->header.id, 0, sizeof(img->header.id));
+    memcpy(img->header.id, digest, SHA1_DIGEST_SIZE);
+  }
+
+  // hand the digest to the signer while the gathered chain drains
+  t_signer sg;
+  signer_start(&sg, img);
+
+  // everything gathered so far lands before the header does
+  vec_flush(&w);
+
+  signer_join(&sg);
+
+  // update signature
+  if (img->dirty_signature) {
+    printf ("   signature %zu at 0x%08x\n", sizeof(img->signature), l->sig_offset);
+
+    vec_seek(&w, l->sig_offset);
+    vec_push(&w, img->signature, sizeof(img->signature));
+    vec_pad(&w, l->sig_offset + sizeof(img->signature), psize);
+    vec_flush(&w);
+  }
+
+  // payloads are on the target before the header can point at them;
+  // a streamed section that ends exactly page-aligned has no padding
+  // fwrite after it, so its tail may still sit in the stdio buffer
+  if (fflush(img->stream))
+    abort_perror(img->fname);
+  if (fsync(fileno(img->stream)))
+    abort_perror(img->fname);
+
+  // the header goes last, once id[] is known
+  printf ("   header %zu\n", sizeof(img->header));
+
+  if (fseek(img->stream, 0, SEEK_SET))
+    abort_perror(img->fname);
+
+  fwrite(&img->header, sizeof(img->header), 1, img->stream);
+  if (ferror(img->stream))
+    abort_perror(img->fname);
+
+  write_padding(img, sizeof(img->header), psize - sizeof(img->header));
+
+  //ftruncate (fileno(img->stream), img->size);
+
+  save_pending_dtb_cache(img);
+}
+
+
+
+void print_bootimg_info(t_abootimg* img)
+{
+  printf ("\nAndroid Boot Image Info:\n\n");
+
+  printf ("* file name = %s %s\n\n", img->fname, img->is_blkdev ? "[block device]":"");
+
+  printf ("* image size = %u bytes (%.2f MB)\n", img->size, (double)img->size/0x100000);
+  //printf ("  page size  = %u bytes\n\n", img->header.page_size);
+
+  printf ("\n<boot_img_hdr>\n");
+
+  unsigned kernel_size = img->header.kernel_size;
+  unsigned ramdisk_size = img->header.ramdisk_size;
+  unsigned second_size = img->header.second_size;
+
+  unsigned dts_size = img->header.dtbs_size;
+
+  // pages
+  t_layout* l = &img->layout;
+  unsigned n_pages = layout_pages(l, kernel_size);
+  unsigned m_pages = layout_pages(l, ramdisk_size);
+  unsigned o_pages = layout_pages(l, second_size);
+  unsigned p_pages = layout_pages(l, dts_size);
+
+
+  //printf ("   magic:        %s\n", img->header.magic);
+
+  printf ("   kernel_size:  %u bytes (%.2f MB), %u pages\n", kernel_size, (double)kernel_size/0x100000, n_pages);
+  printf ("   kernel_addr:  0x%08x\n", img->header.kernel_addr); /* physical load addr */
+
+  printf ("   ramdisk_size: %u bytes (%.2f MB), %u pages\n", ramdisk_size, (double)ramdisk_size/0x100000, m_pages);
+  printf ("   ramdisk_addr: 0x%08x\n", img->header.ramdisk_addr); /* physical load addr */
+
+  printf ("   second_size:  %u bytes (%.2f MB), %u pages\n", second_size, (double)second_size/0x100000, o_pages);
+  printf ("   second_addr:  0x%08x\n", img->header.second_addr); /* physical load addr */
+
+  printf ("   tags_addr:    0x%08x\n", img->header.tags_addr); /* physical addr for kernel tags */
+  printf ("   page_size:    %u bytes\n", img->header.page_size); /* flash page size we assume */
+
+  printf ("   dtbs_size:    %u bytes (%.2f MB), %u pages\n", dts_size, (double)dts_size/0x100000, p_pages);
+
+  printf ("   unused[0]:    %u \n", img->header.unused[0]); /* future expansion: should be 0 */
+
+  printf ("   name:         %s\n\n", img->header.name);
+
+  //printf ("   cmdline: %s\n");
+  if (img->header.cmdline[0])
+    printf ("   cmdline:      %s\n\n", img->header.cmdline);
+  else
+    printf ("   cmdline       empty\n\n");
+
+  printf ("   id[8] 0x%04X%04X%04X%04X%04X%04X%04X%04X\n",
+    img->header.id[0],img->header.id[1],img->header.id[2],img->header.id[3],
+    img->header.id[4],img->header.id[5],img->header.id[6],img->header.id[7]
+  ); /* timestamp / checksum / sha1 / etc */
+
+  printf ("\n<boot_img layout>\n");
+
+  printf ("   kernel offset     0x%08x\n", l->kernel_offset);
+  printf ("   ramdisk offset:   0x%08x\n", l->ramdisk_offset);
+  printf ("   secondary offset: 0x%08x\n", l->second_offset);
+  printf ("   dtbs offset:      0x%08x\n", l->dtbs_offset);
+  printf ("   signature offset: 0x%08x\n", l->sig_offset);
+
+  printf ("\n");
+}
+
+
+// append a JSON string value (with the needed escaping) to the buffer;
+// len is clamped to cap on overflow so cap-len never wraps around and
+// the caller's final length check catches the truncation
+unsigned json_escape(char* buf, unsigned len, unsigned cap, const unsigned char* src)
+{
+  if (len >= cap)
+    return cap;
+  len += snprintf(buf+len, cap-len, "\"");
+  for (; *src && (len+8 < cap); src++) {
+    if ((*src == '"') || (*src == '\\'))
+      len += snprintf(buf+len, cap-len, "\\%c", *src);
+    else if (*src < 0x20)
+      len += snprintf(buf+len, cap-len, "\\u%04x", *src);
+    else
+      buf[len++] = *src;
+  }
+  if (len >= cap)
+    return cap;
+  len += snprintf(buf+len, cap-len, "\"");
+  return (len > cap) ? cap : len;
+}
+
+
+// machine-readable -i output: everything is formatted into one stack
+// buffer and emitted with a single write(), no heap, no stdio
+void print_bootimg_info_machine(t_abootimg* img)
+{
+  char buf[8192];
+  unsigned len = 0;
+  unsigned cap = sizeof(buf);
+  int json;
+  int i;
+
+  if (!strcmp(img->info_format, "json"))
+    json = 1;
+  else if (!strcmp(img->info_format, "tsv"))
+    json = 0;
+  else
+    abort_printf("%s: unknown format (json or tsv)", img->info_format);
+
+  unsigned page_size = img->header.page_size;
+  t_layout* l = &img->layout;
+
+  char id[8*8+1];
+  for (i=0; i<8; i++)
+    sprintf(id + i*8, "%08x", img->header.id[i]);
+
+  // snprintf returns the untruncated length, so every append clamps len
+  // back to cap: cap-len must never wrap around to a huge size
+  if (json) {
+    len += snprintf(buf+len, cap-len, "{\"file\":");
+    if (len > cap) len = cap;
+    len = json_escape(buf, len, cap, (unsigned char*)img->fname);
+    len += snprintf(buf+len, cap-len,
+      ",\"is_blkdev\":%s,\"image_size\":%u,\"page_size\":%u,"
+      "\"kernel_size\":%u,\"kernel_addr\":%u,"
+      "\"ramdisk_size\":%u,\"ramdisk_addr\":%u,"
+      "\"second_size\":%u,\"second_addr\":%u,"
+      "\"tags_addr\":%u,\"dtbs_size\":%u,",
+      img->is_blkdev ? "true" : "false", img->size, page_size,
+      img->header.kernel_size, img->header.kernel_addr,
+      img->header.ramdisk_size, img->header.ramdisk_addr,
+      img->header.second_size, img->header.second_addr,
+      img->header.tags_addr, img->header.dtbs_size);
+    if (len > cap) len = cap;
+    len += snprintf(buf+len, cap-len, "\"name\":");
+    if (len > cap) len = cap;
+    len = json_escape(buf, len, cap, img->header.name);
+    len += snprintf(buf+len, cap-len, ",\"cmdline\":");
+    if (len > cap) len = cap;
+    len = json_escape(buf, len, cap, img->header.cmdline);
+    len += snprintf(buf+len, cap-len,
+      ",\"id\":\"%s\","
+      "\"kernel_offset\":%u,\"ramdisk_offset\":%u,\"second_offset\":%u,"
+      "\"dtbs_offset\":%u,\"signature_offset\":%u}\n",
+      id,
+      l->kernel_offset, l->ramdisk_offset, l->second_offset,
+      l->dtbs_offset, l->sig_offset);
+    if (len > cap) len = cap;
+  }
+  else {
+    len += snprintf(buf+len, cap-len,
+      "file\t%s\nis_blkdev\t%d\nimage_size\t%u\npage_size\t%u\n"
+      "kernel_size\t%u\nkernel_addr\t0x%08x\n"
+      "ramdisk_size\t%u\nramdisk_addr\t0x%08x\n"
+      "second_size\t%u\nsecond_addr\t0x%08x\n"
+      "tags_addr\t0x%08x\ndtbs_size\t%u\n"
+      "name\t%s\ncmdline\t%s\nid\t%s\n"
+      "kernel_offset\t%u\nramdisk_offset\t%u\nsecond_offset\t%u\n"
+      "dtbs_offset\t%u\nsignature_offset\t%u\n",
+      img->fname, img->is_blkdev, img->size, page_size,
+      img->header.kernel_size, img->header.kernel_addr,
+      img->header.ramdisk_size, img->header.ramdisk_addr,
+      img->header.second_size, img->header.second_addr,
+      img->header.tags_addr, img->header.dtbs_size,
+      img->header.name, img->header.cmdline, id,
+      l->kernel_offset, l->ramdisk_offset, l->second_offset,
+      l->dtbs_offset, l->sig_offset);
+    if (len > cap) len = cap;
+  }
+
+  if (len >= cap)
+    abort_printf("%s: info output truncated", img->fname);
+
+  if (write(STDOUT_FILENO, buf, len) != (ssize_t)len)
+    abort_perror("stdout");
+}
+
+
+/* dtbh parsing: every consumer of the in-image device tree table goes
+ * through one loader that reads just the header + entry table (a few
+ * hundred bytes, never the blob), validates num_entries and every
+ * entry's offset/size against dtbs_size up front, and hands out the
+ * checked table. a corrupt image aborts with a message instead of
+ * driving gigabyte reads or wild pointer walks. */
+
+typedef struct
+{
+  dtbs_t      hdr;
+  dt_entry_t* dt;       /* validated entry table (mapping or arena) */
+  unsigned    doffset;  /* absolute offset of the dtbs section */
+  unsigned    dsize;
+} t_dtbh;
+
+
+void load_dtbh(t_abootimg* img, unsigned doffset, t_dtbh* t)
+{
+  unsigned dsize = img->header.dtbs_size;
+
+  t->doffset = doffset;
+  t->dsize = dsize;
+
+  if (dsize < sizeof(dtbs_t))
+    abort_printf("%s: dtbs section (%u bytes) too small for a DTBH\n",
+                 img->fname, dsize);
+
+  fflush(img->stream);
+  if (pread(fileno(img->stream), &t->hdr, sizeof(dtbs_t), doffset)
+      != (ssize_t)sizeof(dtbs_t))
+    abort_perror(img->fname);
+
+  if (t->hdr.magic != DTBH_MAGIC)
+    abort_printf("%s: bad DTBH magic 0x%08x\n", img->fname, t->hdr.magic);
+
+  unsigned ne = t->hdr.num_entries;
+  if (ne > (dsize - sizeof(dtbs_t)) / sizeof(dt_entry_t))
+    abort_printf("%s: DTBH num_entries %u exceeds dtbs section\n",
+                 img->fname, ne);
+
+  unsigned tsize = ne * sizeof(dt_entry_t);
+  if (img->map && (doffset + sizeof(dtbs_t) + tsize <= img->map_size))
+    // zero copy, the table is served straight from the mapping
+    t->dt = (dt_entry_t*)(img->map + doffset + sizeof(dtbs_t));
+  else {
+    t->dt = (dt_entry_t*)arena_alloc(img, tsize);
+    if (tsize && (pread(fileno(img->stream), t->dt, tsize,
+                        doffset + sizeof(dtbs_t)) != (ssize_t)tsize))
+      abort_perror(img->fname);
+  }
+
+  unsigned i;
+  for (i = 0; i < ne; i++)
+    if ((t->dt[i].offset > dsize)
+        || (t->dt[i].dtb_size > dsize - t->dt[i].offset))
+      abort_printf("%s: dt_entry[%u] exceeds dtbs section\n", img->fname, i);
+}
+
+
+void print_dtbh_info(t_abootimg* img)
+{
+  t_dtbh t;
+  load_dtbh(img, img->layout.dtbs_offset, &t);
+
+  printf ("\n<dtbh_header Info>\n");
+  printf ("  magic:0x%08x, version:0x%08x, num_entries:0x%08x\n",
+    t.hdr.magic, t.hdr.version, t.hdr.num_entries);
+
+  dt_entry_t *dt = t.dt;
+  int ientry;
+  for (ientry = 0; ientry<t.hdr.num_entries; ientry++) {
+    printf ("\ndt_entry[%02d]\n", ientry);
+    printf ("        chip_id: 0x%08x\n", dt[ientry].chip_id);
+    printf ("    platform_id: 0x%08x\n", dt[ientry].platform_id);
+    printf ("     subtype_id: 0x%08x\n", dt[ientry].subtype_id);
+    printf ("         hw_rev: 0x%08x\n", dt[ientry].hw_rev);
+    printf ("     hw_rev_end: 0x%08x\n", dt[ientry].hw_rev_end);
+    printf ("         offset: 0x%08x\n", dt[ientry].offset);
+    printf ("       dtb size: 0x%08x\n", dt[ientry].dtb_size);
+  }
+
+  printf ("\n");
+}
+
+
+
+typedef struct
+{
+  t_abootimg*   img;
+  char*         name;
+  unsigned      offset;
+  unsigned      size;
+  unsigned char digest[SHA1_DIGEST_SIZE];
+} t_verify_job;
+
+
+void* verify_worker(void* arg)
+{
+  t_verify_job* job = (t_verify_job*)arg;
+
+  sha1_ctx ctx;
+  sha1_init(&ctx);
+  hash_image_section(job->img, &ctx, job->offset, job->size);
+  sha1_final(&ctx, job->digest);
+
+  return NULL;
+}
+
+
+void verify_bootimg(t_abootimg* img)
+{
+  t_layout* l = &img->layout;
+  int i, j;
+
+  printf ("verifying %s\n", img->fname);
+
+  // a fresh sidecar was proven against this very image state when it
+  // was written: report its digests without touching the payload bytes
+  if (img->sidecar_ok) {
+    static char* names[4] = { "kernel", "ramdisk", "second", "dtbs" };
+    unsigned sizes[4] = { img->header.kernel_size, img->header.ramdisk_size,
+                          img->header.second_size, img->header.dtbs_size };
+    for (i=0; i<4; i++) {
+      if (!sizes[i])
+        continue;
+      printf ("   %-8s sha1 ", names[i]);
+      for (j=0; j<SHA1_DIGEST_SIZE; j++)
+        printf ("%02x", img->sidecar.sha1[i][j]);
+      printf ("  (%u bytes)\n", sizes[i]);
+    }
+    printf ("   id[] matches: image OK [sidecar]\n");
+    return;
+  }
+
+  t_verify_job jobs[4] = {
+    { img, "kernel",  l->kernel_offset,  img->header.kernel_size,  {0} },
+    { img, "ramdisk", l->ramdisk_offset, img->header.ramdisk_size, {0} },
+    { img, "second",  l->second_offset,  img->header.second_size,  {0} },
+    { img, "dtbs",    l->dtbs_offset,    img->header.dtbs_size,    {0} },
+  };
+  int num_jobs = sizeof(jobs)/sizeof(jobs[0]);
+  pthread_t threads[num_jobs];
+
+  // per-section digests are independent, hash them across cores
+  for (i=0; i<num_jobs; i++)
+    if (pthread_create(&threads[i], NULL, verify_worker, &jobs[i]))
+      abort_perror("pthread_create");
+  for (i=0; i<num_jobs; i++) {
+    pthread_join(threads[i], NULL);
+    if (!jobs[i].size)
+      continue;
+    printf ("   %-8s sha1 ", jobs[i].name);
+    for (j=0; j<SHA1_DIGEST_SIZE; j++)
+      printf ("%02x", jobs[i].digest[j]);
+    printf ("  (%u bytes)\n", jobs[i].size);
+  }
+
+  // the id[] chain covers kernel+ramdisk+second sequentially; the data
+  // is hot in the page cache after the parallel pass, so this second
+  // walk costs no extra disk read
+  sha1_ctx ctx;
+  sha1_init(&ctx);
+  hash_image_section(img, &ctx, l->kernel_offset, img->header.kernel_size);
+  sha1_update(&ctx, &img->header.kernel_size, sizeof(img->header.kernel_size));
+  hash_image_section(img, &ctx, l->ramdisk_offset, img->header.ramdisk_size);
+  sha1_update(&ctx, &img->header.ramdisk_size, sizeof(img->header.ramdisk_size));
+  hash_image_section(img, &ctx, l->second_offset, img->header.second_size);
+  sha1_update(&ctx, &img->header.second_size, sizeof(img->header.second_size));
+
+  unsigned char digest[SHA1_DIGEST_SIZE];
+  sha1_final(&ctx, digest);
+
+  unsigned id[8];
+  memset(id, 0, sizeof(id));
+  memcpy(id, digest, SHA1_DIGEST_SIZE);
+
+  int has_id = 0;
+  for (i=0; i<8; i++)
+    if (img->header.id[i])
+      has_id = 1;
+
+  if (!has_id)
+    abort_printf("%s: header carries no id[], cannot verify", img->fname);
+
+  if (memcmp(id, img->header.id, sizeof(id)))
+    abort_printf("%s: id[] mismatch, image is corrupt or was written without id", img->fname);
+
+  printf ("   id[] matches: image OK\n");
+
+  // the image is proven good as it sits right now: record the result
+  unsigned char digests[4][SHA1_DIGEST_SIZE];
+  for (i=0; i<num_jobs; i++)
+    memcpy(digests[i], jobs[i].digest, SHA1_DIGEST_SIZE);
+  sidecar_save(img, digests);
+}
+
+
+void write_bootimg_config(t_abootimg* img)
+{
+  printf ("writing boot image config in %s\n", img->config_fname);
+
+  FILE* config_file = fopen(img->config_fname, "w");
+  if (!config_file)
+    abort_perror(img->config_fname);
+
+  fprintf(config_file, "bootsize = 0x%x\n", img->size);
+  fprintf(config_file, "pagesize = 0x%x\n", img->header.page_size);
+
+  fprintf(config_file, "kerneladdr = 0x%x\n", img->header.kernel_addr);
+  fprintf(config_file, "ramdiskaddr = 0x%x\n", img->header.ramdisk_addr);
+  fprintf(config_file, "secondaddr = 0x%x\n", img->header.second_addr);
+  fprintf(config_file, "tagsaddr = 0x%x\n", img->header.tags_addr);
+
+  fprintf(config_file, "name = %s\n", img->header.name);
+  fprintf(config_file, "cmdline = %s\n", img->header.cmdline);
+  
+  fclose(config_file);
+}
+
+
+
+// write size bytes of the image, starting at offset, into fname without
+// round-tripping them through a heap buffer:
+// - copy_file_range lets the kernel move the pages directly
+// - otherwise write() straight from the read-only mapping
+// - otherwise fall back to the historic malloc+fread+fwrite path
+void extract_section(t_abootimg* img, unsigned offset, unsigned size, char* fname)
+{
+  int ofd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (ofd == -1)
+    abort_perror(fname);
+
+#ifdef __linux__
+  if (!img->is_blkdev) {
+    off_t off_in = offset;
+    unsigned left = size;
+    ssize_t cb = copy_file_range(fileno(img->stream), &off_in, ofd, NULL, left, 0);
+    if (cb >= 0) {
+      left -= cb;
+      while (left) {
+        cb = copy_file_range(fileno(img->stream), &off_in, ofd, NULL, left, 0);
+        if (cb <= 0)
+          abort_perror(fname);
+        left -= cb;
+      }
+      close(ofd);
+      return;
+    }
+    // EXDEV/EINVAL/ENOSYS: fall through to the mapping
+  }
+#endif
+
+  if (img->map && (offset + size <= img->map_size)) {
+    char* p = img->map + offset;
+    unsigned left = size;
+    while (left) {
+      ssize_t wb = write(ofd, p, left);
+      if (wb <= 0)
+        abort_perror(fname);
+      p += wb;
+      left -= wb;
+    }
+    close(ofd);
+    return;
+  }
+
+  void* b = arena_alloc(img, size);
+
+  // positional read: the stream offset is shared between the extract
+  // threads, the file offset must not be
+  if (pread(fileno(img->stream), b, size, offset) != (ssize_t)size)
+    abort_perror(img->fname);
+
+  char* p = b;
+  unsigned left = size;
+  while (left) {
+    ssize_t wb = write(ofd, p, left);
+    if (wb <= 0)
+      abort_perror(fname);
+    p += wb;
+    left -= wb;
+  }
+
+  close(ofd);
+}
+
+
+void extract_kernel(t_abootimg* img)
+{
+  printf ("extracting kernel in %s\n", img->kernel_fname);
+
+  extract_section(img, img->layout.kernel_offset, img->header.kernel_size,
+                  img->kernel_fname);
+}
+
+
+void extract_ramdisk(t_abootimg* img)
+{
+  printf ("extracting ramdisk in %s\n", img->ramdisk_fname);
+
+  extract_section(img, img->layout.ramdisk_offset, img->header.ramdisk_size,
+                  img->ramdisk_fname);
+}
+
+
+void extract_second(t_abootimg* img)
+{
+  unsigned ssize = img->header.second_size;
+
+  if (!ssize) // Second Stage not present
+    return;
+
+  unsigned soffset = img->layout.second_offset;
+
+  printf ("extracting second stage image in %s\n", img->second_fname);
+
+  extract_section(img, soffset, ssize, img->second_fname);
+}
+
+
+void extract_dtbs(t_abootimg* img)
+{
+  unsigned dsize = img->header.dtbs_size;
+  unsigned doffset = img->layout.dtbs_offset;
+
+  if (!dsize) // no device trees present
+    return;
+
+  printf ("extracting ");
+
+  t_dtbh t;
+  load_dtbh(img, doffset, &t);
+
+  char dtbname[256] = {0};
+
+  sprintf(dtbname,"%s.dtbh",img->dtbs_fname);
+
+  printf ("DTBH %s\n", dtbname);
+
+  FILE* dtbs_file = fopen(dtbname, "w");
+  if (!dtbs_file)
+    abort_perror(dtbname);
+
+  fwrite(&t.hdr, sizeof(dtbs_t), 1, dtbs_file);
+  fwrite(t.dt, sizeof(dt_entry_t), t.hdr.num_entries, dtbs_file);
+  if (ferror(dtbs_file))
+    abort_perror(dtbname);
+
+  fclose(dtbs_file);
+
+  dt_entry_t *dt = t.dt;
+
+  int ientry;
+
+  for (ientry = 0; ientry<t.hdr.num_entries; ientry++) {
+    sprintf(dtbname,"%s.dtb_p%d",img->dtbs_fname,ientry);
+
+    printf (" .. dtb %s offset 0x%08x, size 0x%08x\n", dtbname, dt[ientry].offset, dt[ientry].dtb_size);
+
+    // each dtb goes straight from mapping (or ranged reads) to its
+    // file; the blob is never materialized as a whole
+    extract_section(img, doffset + dt[ientry].offset, dt[ientry].dtb_size, dtbname);
+  }
+}
+
+
+// the sections sit at disjoint offsets and all extract paths use
+// positional I/O, so they can be pulled out concurrently
+void* extract_kernel_worker(void* arg)  { extract_kernel((t_abootimg*)arg);  return NULL; }
+void* extract_ramdisk_worker(void* arg) { extract_ramdisk((t_abootimg*)arg); return NULL; }
+void* extract_second_worker(void* arg)  { extract_second((t_abootimg*)arg);  return NULL; }
+void* extract_dtbs_worker(void* arg)    { extract_dtbs((t_abootimg*)arg);    return NULL; }
+
+void extract_all(t_abootimg* img)
+{
+  void* (*workers[])(void*) = {
+    extract_kernel_worker,
+    extract_ramdisk_worker,
+    extract_second_worker,
+    extract_dtbs_worker
+  };
+  int num_workers = sizeof(workers)/sizeof(workers[0]);
+  pthread_t threads[num_workers];
+  int i;
+
+  for (i=0; i<num_workers; i++)
+    if (pthread_create(&threads[i], NULL, workers[i], img))
+      abort_perror("pthread_create");
+  for (i=0; i<num_workers; i++)
+    pthread_join(threads[i], NULL);
+}
+
+
+// extract the single dtb matching a device selector, reading only the
+// dtbh header and entry table (a few hundred bytes) plus that dtb,
+// never the whole dtbs blob
+void extract_matching_dtb(t_abootimg* img)
+{
+  unsigned dsize = img->header.dtbs_size;
+  unsigned doffset = img->layout.dtbs_offset;
+
+  if (!dsize)
+    abort_printf("%s: image carries no device trees", img->fname);
+
+  // the selector: only the given keys are compared
+  unsigned chip_id = 0, platform_id = 0, subtype_id = 0, hw_rev = 0;
+  int has_chip = 0, has_platform = 0, has_subtype = 0, has_hw_rev = 0;
+
+  char* sel = strdup(img->dtb_match);
+  if (!sel)
+    abort_perror(NULL);
+  char* save = NULL;
+  char* tok;
+  for (tok = strtok_r(sel, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    char* eq = strchr(tok, '=');
+    if (!eq)
+      abort_printf("%s: bad selector entry", tok);
+    *eq = '\0';
+    unsigned value = strtoul(eq+1, NULL, 0);
+    if      (!strcmp(tok, "chip_id"))     { chip_id = value;     has_chip = 1; }
+    else if (!strcmp(tok, "platform_id")) { platform_id = value; has_platform = 1; }
+    else if (!strcmp(tok, "subtype_id"))  { subtype_id = value;  has_subtype = 1; }
+    else if (!strcmp(tok, "hw_rev"))      { hw_rev = value;      has_hw_rev = 1; }
+    else
+      abort_printf("%s: unknown selector key", tok);
+  }
+  free(sel);
+
+  t_dtbh t;
+  load_dtbh(img, doffset, &t);
+  dt_entry_t* dt = t.dt;
+
+  // pick the matching entry with the highest hw_rev, the way the
+  // bootloader selects among overlapping revision ranges
+  int best = -1;
+  unsigned ientry;
+  for (ientry = 0; ientry < t.hdr.num_entries; ientry++) {
+    if (has_chip && (dt[ientry].chip_id != chip_id))
+      continue;
+    if (has_platform && (dt[ientry].platform_id != platform_id))
+      continue;
+    if (has_subtype && (dt[ientry].subtype_id != subtype_id))
+      continue;
+    if (has_hw_rev) {
+      unsigned end = (dt[ientry].hw_rev_end < dt[ientry].hw_rev)
+                     ? dt[ientry].hw_rev : dt[ientry].hw_rev_end;
+      if ((hw_rev < dt[ientry].hw_rev) || (hw_rev > end))
+        continue;
+    }
+    if ((best < 0) || (dt[ientry].hw_rev > dt[best].hw_rev))
+      best = ientry;
+  }
+
+  if (best < 0)
+    abort_printf("%s: no dtb matches %s", img->fname, img->dtb_match);
+
+  printf ("extracting dt_entry[%02d] (chip_id 0x%08x, hw_rev 0x%08x-0x%08x) in %s\n",
+          best, dt[best].chip_id, dt[best].hw_rev, dt[best].hw_rev_end, img->dtbs_fname);
+
+  extract_section(img, doffset + dt[best].offset, dt[best].dtb_size, img->dtbs_fname);
+}
+
+
+void extract_signature(t_abootimg* img)
+{
+  unsigned goffset = img->layout.sig_offset;
+
+  if (goffset + sizeof(img->signature) > img->size)
+    abort_printf("%s: no signature page\n", img->fname);
+
+  printf ("extracting signature in %s\n", img->signature_fname);
+
+  extract_section(img, goffset, sizeof(img->signature), img->signature_fname);
+}
+
+
+/* ramdisk listing (--ramdisk-ls): the compliance scanners used to
+ * extract the ramdisk, gunzip it and cpio -t it -- three processes and
+ * two temp files per query. here the section is pulled straight out of
+ * the image through an in-process inflate into a newc header scanner;
+ * file data is inflated into a discard sink, so a listing costs
+ * decompress bandwidth and nothing else. */
+
+typedef struct
+{
+  t_abootimg*   img;
+  unsigned      off;    /* next compressed byte in the image */
+  unsigned      left;   /* compressed bytes still in the section */
+  int           raw;    /* uncompressed newc cpio, no inflate */
+  z_stream      zs;
+  unsigned char in[64*1024];
+} t_rd_stream;
+
+
+// read a chunk of the ramdisk section, from the mapping when it
+// covers it
+void rd_fill(t_rd_stream* s, unsigned char* buf, unsigned len)
+{
+  t_abootimg* img = s->img;
+
+  if (img->map && (s->off + len <= img->map_size))
+    memcpy(buf, img->map + s->off, len);
+  else if (pread(fileno(img->stream), buf, len, s->off) != (ssize_t)len)
+    abort_perror(img->fname);
+
+  s->off += len;
+  s->left -= len;
+}
+
+
+// hand out exactly len decompressed bytes, into buf or (when buf is
+// NULL) into a discard sink -- that is how file data is skipped, since
+// a compressed stream cannot seek
+void rd_pull(t_rd_stream* s, unsigned char* buf, unsigned len)
+{
+  unsigned char sink[4096];
+
+  while (len) {
+    unsigned chunk = buf ? len : (len < sizeof(sink) ? len : sizeof(sink));
+
+    if (s->raw) {
+      if (chunk > s->left)
+        abort_printf("%s: ramdisk cpio truncated", s->img->fname);
+      rd_fill(s, buf ? buf : sink, chunk);
+    }
+    else {
+      s->zs.next_out = buf ? buf : sink;
+      s->zs.avail_out = chunk;
+      while (s->zs.avail_out) {
+        if (!s->zs.avail_in && s->left) {
+          unsigned rb = (s->left < sizeof(s->in)) ? s->left : sizeof(s->in);
+          rd_fill(s, s->in, rb);
+          s->zs.next_in = s->in;
+          s->zs.avail_in = rb;
+        }
+        int zr = inflate(&s->zs, Z_NO_FLUSH);
+        if (zr == Z_STREAM_END) {
+          if (s->zs.avail_out)
+            abort_printf("%s: ramdisk cpio truncated", s->img->fname);
+          break;
+        }
+        if (zr != Z_OK)
+          abort_printf("%s: ramdisk inflate failed (%d)", s->img->fname, zr);
+      }
+    }
+
+    if (buf)
+      buf += chunk;
+    len -= chunk;
+  }
+}
+
+
+unsigned cpio_hex(char* p)
+{
+  char tmp[9];
+  memcpy(tmp, p, 8);
+  tmp[8] = '\0';
+  return strtoul(tmp, NULL, 16);
+}
+
+
+void ramdisk_ls(t_abootimg* img)
+{
+  unsigned rsize = img->header.ramdisk_size;
+  unsigned roffset = img->layout.ramdisk_offset;
+
+  if (!rsize)
+    abort_printf("%s: image carries no ramdisk", img->fname);
+
+  t_rd_stream s;
+  memset(&s, 0, sizeof(s));
+  s.img = img;
+  s.off = roffset;
+  s.left = rsize;
+
+  // gzip (or zlib) is inflated; a bare newc archive is scanned as is
+  unsigned char peek[2];
+  rd_fill(&s, peek, 2);
+  s.off = roffset;
+  s.left = rsize;
+
+  if ((peek[0] == 0x1f) && (peek[1] == 0x8b)) {
+    if (inflateInit2(&s.zs, 15 + 32) != Z_OK)
+      abort_printf("%s: inflateInit failed", img->fname);
+  }
+  else if ((peek[0] == '0') && (peek[1] == '7'))
+    s.raw = 1;
+  else
+    abort_printf("%s: ramdisk is neither gzip nor newc cpio", img->fname);
+
+  char hdr[110];
+  char name[4096];
+  unsigned pos = 0;
+  unsigned entries = 0;
+
+  while (1) {
+    rd_pull(&s, (unsigned char*)hdr, sizeof(hdr));
+    pos += sizeof(hdr);
+
+    if (memcmp(hdr, "070701", 6) && memcmp(hdr, "070702", 6))
+      abort_printf("%s: bad cpio header magic at entry %u", img->fname, entries);
+
+    unsigned filesize = cpio_hex(hdr + 54);
+    unsigned namesize = cpio_hex(hdr + 94);
+
+    if ((namesize < 2) || (namesize > sizeof(name)))
+      abort_printf("%s: bad cpio name size %u", img->fname, namesize);
+
+    rd_pull(&s, (unsigned char*)name, namesize);
+    pos += namesize;
+    name[namesize-1] = '\0';
+
+    if (!strcmp(name, "TRAILER!!!"))
+      break;
+
+    printf ("%s\n", name);
+    entries++;
+
+    // names and data are 4-byte aligned within the decompressed stream
+    unsigned pad = (4 - (pos % 4)) % 4;
+    rd_pull(&s, NULL, pad);
+    pos += pad;
+
+    rd_pull(&s, NULL, filesize);
+    pos += filesize;
+    pad = (4 - (pos % 4)) % 4;
+    rd_pull(&s, NULL, pad);
+    pos += pad;
+  }
+
+  if (!s.raw)
+    inflateEnd(&s.zs);
+
+  printf ("%u entries\n", entries);
+}
+
+/* packed boot image archive (--pack-archive): many per-device images
+ * in one file with a section-level content index, so the kernel a
+ * fleet of variants shares is stored once.
+ *
+ * layout: t_abar_hdr | chunk data ... | image table | chunk table
+ *
+ * a chunk is one section's bytes keyed by sha1+size; an image is its
+ * boot_img_hdr plus chunk references for kernel/ramdisk/second/dtbs
+ * and the tail (signature page and anything after it). extraction is
+ * an index lookup plus ranged reads of just that image's chunks. */
+
+#define ABAR_MAGIC      "ABOOTAR!"
+#define ABAR_VERSION    1
+#define ABAR_NAME_SIZE  64
+#define ABAR_SECTIONS   5
+
+typedef struct
+{
+  unsigned char sha1[SHA1_DIGEST_SIZE];
+  uint64_t      offset;  /* of the bytes in the archive */
+  unsigned      size;
+} t_abar_chunk;
+
+typedef struct
+{
+  char          name[ABAR_NAME_SIZE];
+  boot_img_hdr  header;
+  unsigned      file_size;
+  int           chunk[ABAR_SECTIONS];  /* chunk table index, -1 if absent */
+} t_abar_image;
+
+typedef struct
+{
+  char          magic[8];
+  unsigned      version;
+  unsigned      num_images;
+  unsigned      num_chunks;
+  uint64_t      index_offset;
+} t_abar_hdr;
+
+
+// section offset/size pairs in header order: kernel, ramdisk, second,
+// dtbs, tail (signature page onward, up to the file size)
+void abar_sections(boot_img_hdr* h, unsigned file_size,
+                   unsigned offset[ABAR_SECTIONS], unsigned size[ABAR_SECTIONS])
+{
+  t_layout l;
+  compute_layout(h, &l);
+
+  offset[0] = l.kernel_offset;    size[0] = h->kernel_size;
+  offset[1] = l.ramdisk_offset;   size[1] = h->ramdisk_size;
+  offset[2] = l.second_offset;    size[2] = h->second_size;
+  offset[3] = l.dtbs_offset;      size[3] = h->dtbs_size;
+  offset[4] = l.sig_offset;
+  size[4] = (file_size > offset[4]) ? file_size - offset[4] : 0;
+}
+
+
+void pack_archive(t_abootimg* img)
+{
+  FILE* out = fopen(img->fname, "w");
+  if (!out)
+    abort_perror(img->fname);
+
+  t_abar_hdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, ABAR_MAGIC, sizeof(hdr.magic));
+  hdr.version = ABAR_VERSION;
+  fwrite(&hdr, sizeof(hdr), 1, out);
+  if (ferror(out))
+    abort_perror(img->fname);
+
+  t_abar_chunk* chunks = NULL;
+  t_abar_image* images = NULL;
+  unsigned nchunks = 0;
+  uint64_t in_bytes = 0;
+
+  int i;
+  for (i = 0; i < img->archive_argc; i++) {
+    char* iname = img->archive_args[i];
+
+    FILE* in = fopen(iname, "r");
+    if (!in)
+      abort_perror(iname);
+    struct stat st;
+    if (fstat(fileno(in), &st))
+      abort_perror(iname);
+    in_bytes += st.st_size;
+
+    images = realloc(images, (i+1) * sizeof(t_abar_image));
+    if (!images)
+      abort_perror(NULL);
+    t_abar_image* im = &images[i];
+    memset(im, 0, sizeof(*im));
+
+    if (fread(&im->header, sizeof(im->header), 1, in) != 1)
+      abort_perror(iname);
+    if (strncmp((char*)im->header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE))
+      abort_printf("%s: no Android Magic Value\n", iname);
+
+    char* base = strrchr(iname, '/');
+    base = base ? base+1 : iname;
+    strncpy(im->name, base, ABAR_NAME_SIZE-1);
+    im->file_size = st.st_size;
+
+    unsigned soffset[ABAR_SECTIONS];
+    unsigned ssize[ABAR_SECTIONS];
+    abar_sections(&im->header, im->file_size, soffset, ssize);
+
+    unsigned shared = 0;
+    int j;
+    for (j = 0; j < ABAR_SECTIONS; j++) {
+      im->chunk[j] = -1;
+      if (!ssize[j])
+        continue;
+
+      char* buf = malloc(ssize[j]);
+      if (!buf)
+        abort_perror(NULL);
+      if (pread(fileno(in), buf, ssize[j], soffset[j]) != (ssize_t)ssize[j])
+        abort_perror(iname);
+
+      unsigned char digest[SHA1_DIGEST_SIZE];
+      sha1_ctx ctx;
+      sha1_init(&ctx);
+      sha1_update(&ctx, buf, ssize[j]);
+      sha1_final(&ctx, digest);
+
+      unsigned k;
+      for (k = 0; k < nchunks; k++)
+        if ((chunks[k].size == ssize[j])
+            && !memcmp(chunks[k].sha1, digest, SHA1_DIGEST_SIZE))
+          break;
+
+      if (k == nchunks) {
+        chunks = realloc(chunks, (nchunks+1) * sizeof(t_abar_chunk));
+        if (!chunks)
+          abort_perror(NULL);
+        memcpy(chunks[k].sha1, digest, SHA1_DIGEST_SIZE);
+        chunks[k].offset = ftell(out);
+        chunks[k].size = ssize[j];
+        fwrite(buf, ssize[j], 1, out);
+        if (ferror(out))
+          abort_perror(img->fname);
+        nchunks++;
+      }
+      else
+        shared += ssize[j];
+
+      im->chunk[j] = k;
+      free(buf);
+    }
+    fclose(in);
+
+    printf ("   %s: %u bytes, %u shared\n", im->name, im->file_size, shared);
+  }
+
+  hdr.num_images = img->archive_argc;
+  hdr.num_chunks = nchunks;
+  hdr.index_offset = ftell(out);
+
+  fwrite(images, sizeof(t_abar_image), hdr.num_images, out);
+  fwrite(chunks, sizeof(t_abar_chunk), nchunks, out);
+  if (ferror(out) || fseek(out, 0, SEEK_SET))
+    abort_perror(img->fname);
+  fwrite(&hdr, sizeof(hdr), 1, out);
+  if (ferror(out))
+    abort_perror(img->fname);
+
+  uint64_t out_bytes = hdr.index_offset
+    + hdr.num_images * sizeof(t_abar_image) + nchunks * sizeof(t_abar_chunk);
+  printf ("packed %u images (%llu bytes) into %s (%llu bytes, %u chunks)\n",
+          hdr.num_images, (unsigned long long)in_bytes, img->fname,
+          (unsigned long long)out_bytes, nchunks);
+
+  fclose(out);
+  free(images);
+  free(chunks);
+}
+
+
+void unpack_archive(t_abootimg* img)
+{
+  FILE* in = fopen(img->fname, "r");
+  if (!in)
+    abort_perror(img->fname);
+
+  t_abar_hdr hdr;
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1)
+    abort_perror(img->fname);
+  if (memcmp(hdr.magic, ABAR_MAGIC, sizeof(hdr.magic))
+      || (hdr.version != ABAR_VERSION))
+    abort_printf("%s: not an abootimg archive\n", img->fname);
 
-  fclose(kernel_file);
-  free(k);*/
+  t_abar_image* images = malloc(hdr.num_images * sizeof(t_abar_image));
+  t_abar_chunk* chunks = malloc(hdr.num_chunks * sizeof(t_abar_chunk));
+  if (!images || !chunks)
+    abort_perror(NULL);
+
+  if (fseek(in, hdr.index_offset, SEEK_SET)
+      || (fread(images, sizeof(t_abar_image), hdr.num_images, in) != hdr.num_images)
+      || (fread(chunks, sizeof(t_abar_chunk), hdr.num_chunks, in) != hdr.num_chunks))
+    abort_perror(img->fname);
+
+  unsigned i;
+
+  if (!img->archive_argc) {
+    printf ("%s: %u images, %u chunks\n", img->fname, hdr.num_images, hdr.num_chunks);
+    for (i = 0; i < hdr.num_images; i++)
+      printf ("   %-24s %u bytes\n", images[i].name, images[i].file_size);
+    fclose(in);
+    free(images);
+    free(chunks);
+    return;
+  }
+
+  char* want = img->archive_args[0];
+  char* oname = (img->archive_argc > 1) ? img->archive_args[1] : want;
+
+  t_abar_image* im = NULL;
+  for (i = 0; i < hdr.num_images; i++)
+    if (!strcmp(images[i].name, want))
+      im = &images[i];
+  if (!im)
+    abort_printf("%s: no image named %s\n", img->fname, want);
+
+  printf ("extracting %s in %s\n", want, oname);
+
+  FILE* out = fopen(oname, "w");
+  if (!out)
+    abort_perror(oname);
+
+  fwrite(&im->header, sizeof(im->header), 1, out);
+  if (ferror(out))
+    abort_perror(oname);
+
+  unsigned soffset[ABAR_SECTIONS];
+  unsigned ssize[ABAR_SECTIONS];
+  abar_sections(&im->header, im->file_size, soffset, ssize);
+
+  char* buf = malloc(1024*1024);
+  if (!buf)
+    abort_perror(NULL);
+
+  int j;
+  for (j = 0; j < ABAR_SECTIONS; j++) {
+    if (im->chunk[j] < 0)
+      continue;
+    t_abar_chunk* c = &chunks[im->chunk[j]];
+
+    uint64_t from = c->offset;
+    unsigned to = soffset[j];
+    unsigned left = c->size;
+    while (left) {
+      unsigned chunk = (left < 1024*1024) ? left : 1024*1024;
+      if (pread(fileno(in), buf, chunk, from) != (ssize_t)chunk)
+        abort_perror(img->fname);
+      if (pwrite(fileno(out), buf, chunk, to) != (ssize_t)chunk)
+        abort_perror(oname);
+      from += chunk;
+      to += chunk;
+      left -= chunk;
+    }
+  }
+
+  // the padding between sections stays a hole; the file length matches
+  // the original image
+  fflush(out);
+  if (ftruncate(fileno(out), im->file_size))
+    abort_perror(oname);
+
+  free(buf);
+  fclose(out);
+  fclose(in);
+  free(images);
+  free(chunks);
 }
 
+
 t_abootimg* new_bootimg()
 {
   t_abootimg* img;
@@ -1325,6 +4122,8 @@ t_abootimg* new_bootimg()
   img->dtbs_fname = "platform";
   img->signature_fname = "signature";
 
+  pthread_mutex_init(&img->arena_lock, NULL);
+
   memcpy(img->header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
   img->header.page_size = 2048;  // a sensible default page size
 
@@ -1332,11 +4131,17 @@ t_abootimg* new_bootimg()
 }
 
 
-int main(int argc, char** argv)
+void run_batch(char* fname);
+void run_create_farm(t_abootimg* img);
+void run_bench(t_abootimg* img);
+void run_serve(t_abootimg* img);
+
+
+void process_bootimg(enum command cmd, t_abootimg* bootimg)
 {
-  t_abootimg* bootimg = new_bootimg();
+  double t0;
 
-  switch(parse_args(argc, argv, bootimg))
+  switch(cmd)
   {
     case none:
       printf("error - bad arguments\n\n");
@@ -1349,28 +4154,38 @@ int main(int argc, char** argv)
 
     case info:
       open_bootimg(bootimg, "r");
+      t0 = prof_begin();
       read_header(bootimg);
-      print_bootimg_info(bootimg);
+      prof_end("read_header", t0);
+      if (bootimg->info_format)
+        print_bootimg_info_machine(bootimg);
+      else
+        print_bootimg_info(bootimg);
       break;
 
     case extract:
       open_bootimg(bootimg, "r");
+      t0 = prof_begin();
       read_header(bootimg);
+      prof_end("read_header", t0);
       write_bootimg_config(bootimg);
-      extract_kernel(bootimg);
-      extract_ramdisk(bootimg);
-      extract_second(bootimg);
-      extract_dtbs(bootimg);
+      extract_all(bootimg);
       extract_signature(bootimg);
       break;
-    
+
     case update:
       open_bootimg(bootimg, "r+");
+      t0 = prof_begin();
       read_header(bootimg);
+      prof_end("read_header", t0);
       update_header(bootimg);
+      t0 = prof_begin();
       update_images(bootimg);
+      prof_end("update_images", t0);
       //print_bootimg_info(bootimg);
+      t0 = prof_begin();
       write_bootimg(bootimg);
+      prof_end("write_bootimg", t0);
       break;
 
     case create:
@@ -1379,19 +4194,842 @@ int main(int argc, char** argv)
         break;
       }
       check_if_block_device(bootimg);
-      open_bootimg(bootimg, "w");
+      if (bootimg->flash_resume) {
+        // keep what an interrupted flash already wrote
+        bootimg->stream = fopen(bootimg->fname, "r+");
+        if (!bootimg->stream)
+          open_bootimg(bootimg, "w");
+      }
+      else
+        open_bootimg(bootimg, "w");
       update_header(bootimg);
+      t0 = prof_begin();
       update_images(bootimg);
+      prof_end("update_images", t0);
       if (check_boot_img_header(bootimg))
         abort_printf("%s: Sanity cheks failed", bootimg->fname);
+      t0 = prof_begin();
       write_bootimg(bootimg);
+      prof_end("write_bootimg", t0);
+      break;
+
+    case createfarm:
+      if (!bootimg->kernel_fname || !bootimg->ramdisk_fname) {
+        print_usage();
+        break;
+      }
+      run_create_farm(bootimg);
       break;
+
     case dtbs:
       open_bootimg(bootimg, "r");
+      t0 = prof_begin();
       read_header(bootimg);
+      prof_end("read_header", t0);
       print_dtbh_info(bootimg);
       break;
+
+    case batch:
+      run_batch(bootimg->fname);
+      break;
+
+    case verify:
+      open_bootimg(bootimg, "r");
+      t0 = prof_begin();
+      read_header(bootimg);
+      prof_end("read_header", t0);
+      verify_bootimg(bootimg);
+      break;
+
+    case dtbmatch:
+      open_bootimg(bootimg, "r");
+      t0 = prof_begin();
+      read_header(bootimg);
+      prof_end("read_header", t0);
+      extract_matching_dtb(bootimg);
+      break;
+
+    case bench:
+      run_bench(bootimg);
+      break;
+
+    case packarchive:
+      pack_archive(bootimg);
+      break;
+
+    case unpackarchive:
+      unpack_archive(bootimg);
+      break;
+
+    case serve:
+      run_serve(bootimg);
+      break;
+
+    case ramdiskls:
+      open_bootimg(bootimg, "r");
+      t0 = prof_begin();
+      read_header(bootimg);
+      prof_end("read_header", t0);
+      ramdisk_ls(bootimg);
+      break;
+  }
+}
+
+
+typedef struct
+{
+  char**          lines;
+  int             num_lines;
+  int             next;
+  pthread_mutex_t lock;
+} t_batch;
+
+
+#define MAX_JOB_ARGS 64
+
+// execute one command line worth of arguments in-process (shared by
+// the --batch workers and --bench); the line is consumed
+void run_job(char* line)
+{
+  if ((line[0] == '\0') || (line[0] == '#'))
+    return;
+
+  // split the job line into an argv, honoring double quotes so that
+  // -c "cmdline = ..." entries survive in one argument
+  char* argv[MAX_JOB_ARGS];
+  int argc = 1;
+  argv[0] = "abootimg";
+
+  char* p = line;
+  while (*p) {
+    p += strspn(p, " \t");
+    if (!*p)
+      break;
+    if (argc >= MAX_JOB_ARGS)
+      abort_printf("batch: too many arguments in job: %s", line);
+    if (*p == '"') {
+      argv[argc++] = ++p;
+      p += strcspn(p, "\"");
+    }
+    else {
+      argv[argc++] = p;
+      p += strcspn(p, " \t");
+    }
+    if (*p)
+      *p++ = '\0';
+  }
+  if (argc == 1)
+    return;
+
+  t_abootimg* img = new_bootimg();
+  enum command cmd = parse_args(argc, argv, img);
+  if ((cmd == none) || (cmd == batch) || (cmd == bench))
+    abort_printf("batch: bad job: %s", argv[1]);
+  process_bootimg(cmd, img);
+
+  // release per-job resources; a batch run outlives many jobs
+  arena_release(img);
+  if (img->map)
+    munmap(img->map, img->map_size);
+  if (img->stream)
+    fclose(img->stream);
+  free(img);
+}
+
+
+void* batch_worker(void* arg)
+{
+  t_batch* b = (t_batch*)arg;
+
+  while (1) {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->num_lines)
+      break;
+
+    run_job(b->lines[i]);
+  }
+
+  return NULL;
+}
+
+
+void run_batch(char* fname)
+{
+  FILE* jobs_file = fopen(fname, "r");
+  if (!jobs_file)
+    abort_perror(fname);
+
+  t_batch b;
+  b.lines = NULL;
+  b.num_lines = 0;
+  b.next = 0;
+  pthread_mutex_init(&b.lock, NULL);
+
+  char* line = NULL;
+  size_t len = 0;
+  while (getline(&line, &len, jobs_file) != -1) {
+    char* p = strchr(line, '\n');
+    if (p)
+      *p = '\0';
+    b.lines = realloc(b.lines, (b.num_lines+1) * sizeof(char*));
+    if (!b.lines)
+      abort_perror(NULL);
+    b.lines[b.num_lines++] = line;
+    line = NULL;
+    len = 0;
+  }
+  if (ferror(jobs_file))
+    abort_perror(fname);
+  fclose(jobs_file);
+
+  int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1)
+    num_workers = 1;
+  if (num_workers > b.num_lines)
+    num_workers = b.num_lines;
+
+  printf("running %d jobs from %s on %d workers\n", b.num_lines, fname, num_workers);
+
+  pthread_t workers[num_workers];
+  int i;
+  for (i=0; i<num_workers; i++)
+    if (pthread_create(&workers[i], NULL, batch_worker, &b))
+      abort_perror("pthread_create");
+  for (i=0; i<num_workers; i++)
+    pthread_join(workers[i], NULL);
+}
+
+
+/* create farm (--create-farm): a nightly build writes tens of variant
+ * images that differ only in a couple of header fields or one dtb,
+ * but running --create per variant re-reads the same kernel and
+ * ramdisk every time. here the payloads are loaded once into a
+ * template and shared read-only by parallel variant writers, so the
+ * whole run costs one read of the payloads plus the output writes. */
+
+typedef struct
+{
+  char*       out_fname;
+  t_cfg_batch cfg;        /* header overrides for this variant */
+  int         dtb_index;  /* dtb table entry to swap, -1 for none */
+  char*       dtb_fname;
+} t_variant;
+
+typedef struct
+{
+  t_abootimg*     tmpl;
+  t_variant*      variants;
+  int             num_variants;
+  int             next;
+  pthread_mutex_t lock;
+} t_farm;
+
+
+// one variants line: an output image name, then ';' separated
+// overrides -- either "key = value" config entries or "dtb<N> = <file>"
+// to swap entry N of the device tree table. returns 0 for blank and
+// comment lines. the line buffer is kept, the variant points into it.
+int parse_variant_line(char* line, const char* where, int lineno, t_variant* v)
+{
+  char* p = strchr(line, '\n');
+  if (p)
+    *p = '\0';
+
+  p = line + strspn(line, " \t");
+  if (!*p || (*p == '#'))
+    return 0;
+
+  memset(v, 0, sizeof(*v));
+  v->dtb_index = -1;
+
+  v->out_fname = p;
+  p += strcspn(p, " \t");
+  if (*p)
+    *p++ = '\0';
+
+  while (p && *p) {
+    char* piece = strsep(&p, ";");
+    char* q = piece + strspn(piece, " \t");
+    if (!*q)
+      continue;
+
+    if (!strncmp(q, "dtb", 3) && (q[3] >= '0') && (q[3] <= '9')) {
+      char* end;
+      v->dtb_index = strtoul(q+3, &end, 10);
+      end += strspn(end, " \t");
+      if (*end++ != '=')
+        abort_printf("%s:%d: bad dtb swap entry\n", where, lineno);
+      end += strspn(end, " \t");
+      char* t = end + strlen(end);
+      while ((t > end) && ((t[-1] == ' ') || (t[-1] == '\t')))
+        *--t = '\0';
+      v->dtb_fname = end;
+    }
+    else
+      parse_config_line(q, where, lineno, &v->cfg);
+  }
+
+  return 1;
+}
+
+
+// swap one dtb table entry: the variant gets its own copies of the
+// dtbh page and the pointer/clean tables, loads the replacement blob
+// and relays the entry offsets; deduplicated entries keep pointing at
+// the (new) offset of the entry that materializes their bytes
+void farm_swap_dtb(t_abootimg* img, t_variant* v)
+{
+  unsigned psize = img->header.page_size;
+
+  if (!img->dtbh)
+    abort_printf("%s: template has no dtbs, cannot swap dtb%d",
+                 v->out_fname, v->dtb_index);
+
+  int ne = ((dtbs_t*)img->dtbh)->num_entries;
+  if (v->dtb_index >= ne)
+    abort_printf("%s: dtb%d out of range (table holds %d)",
+                 v->out_fname, v->dtb_index, ne);
+
+  char* dtbh = arena_alloc(img, psize);
+  memcpy(dtbh, img->dtbh, psize);
+  void** dtbs = (void**)arena_alloc(img, ne * sizeof(void*));
+  memcpy(dtbs, img->dtbs, ne * sizeof(void*));
+  int* clean = (int*)arena_alloc(img, ne * sizeof(int));
+  unsigned* old_off = (unsigned*)arena_alloc(img, ne * sizeof(unsigned));
+
+  dt_entry_t* dt = (dt_entry_t*)(dtbh + sizeof(dtbs_t));
+  int i, j;
+  for (i = 0; i < ne; i++) {
+    clean[i] = !dtbs[i];  /* NULL entries share another entry's bytes */
+    old_off[i] = dt[i].offset;
+  }
+
+  FILE* stream = fopen(v->dtb_fname, "r");
+  if (!stream)
+    abort_perror(v->dtb_fname);
+  struct stat st;
+  if (fstat(fileno(stream), &st))
+    abort_perror(v->dtb_fname);
+  char* blob = arena_alloc(img, st.st_size);
+  if (fread(blob, st.st_size, 1, stream) != 1)
+    abort_perror(v->dtb_fname);
+  fclose(stream);
+
+  // entries that shared the swapped entry's bytes must now carry the
+  // old blob themselves; the first one takes over the pointer and the
+  // rest keep sharing through it
+  if (dtbs[v->dtb_index])
+    for (i = 0; i < ne; i++)
+      if (clean[i] && (old_off[i] == old_off[v->dtb_index])) {
+        dtbs[i] = dtbs[v->dtb_index];
+        clean[i] = 0;
+        break;
+      }
+
+  dtbs[v->dtb_index] = blob;
+  clean[v->dtb_index] = 0;
+  dt[v->dtb_index].dtb_size = st.st_size;
+
+  // relay the materialized entries back-to-back, page-aligned
+  unsigned pg = 1;
+  for (i = 0; i < ne; i++) {
+    if (clean[i])
+      continue;
+    dt[i].offset = pg * psize;
+    pg += layout_pages(&img->layout, dt[i].dtb_size);
+  }
+  for (i = 0; i < ne; i++) {
+    if (!clean[i])
+      continue;
+    for (j = 0; j < ne; j++)
+      if (!clean[j] && (j != v->dtb_index) && (old_off[j] == old_off[i]))
+        break;
+    if (j == ne)
+      abort_printf("%s: dtb%d shares its bytes with the swapped entry",
+                   v->out_fname, i);
+    dt[i].offset = dt[j].offset;
+  }
+
+  img->dtbh = dtbh;
+  img->dtbs = dtbs;
+  img->dtb_clean = clean;
+  img->dtb_from = NULL;
+  img->header.dtbs_size = pg * psize;
+}
+
+
+void farm_write_variant(t_abootimg* tmpl, t_variant* v)
+{
+  // a shallow copy shares the payload buffers; everything a writer
+  // mutates (stream, arena, layout) is re-initialized so the workers
+  // never touch the template
+  t_abootimg img = *tmpl;
+  img.fname = v->out_fname;
+  img.stream = NULL;
+  img.map = NULL;
+  img.map_size = 0;
+  img.arena = NULL;
+  pthread_mutex_init(&img.arena_lock, NULL);
+  img.size = 0;
+  img.is_blkdev = 0;
+  img.has_orig = 0;
+  img.dirty_signature = 1;
+  img.flash_delta = 0;
+  img.flash_resume = 0;
+  // the staged cache entries describe the template layout, not the
+  // variant's; never persist them under the variant's name
+  img.dtb_cache_pending = NULL;
+
+  // the payload buffers are shared and already padded for the template
+  // page size; a per-variant page size would shift every offset
+  if (v->cfg.seen & (1u << cfg_pagesize))
+    abort_printf("%s: the page size is fixed by the template", v->out_fname);
+
+  apply_config(&img, &v->cfg);
+
+  if (v->dtb_fname)
+    farm_swap_dtb(&img, v);
+
+  compute_layout(&img.header, &img.layout);
+  if (!img.size)
+    img.size = img.layout.total_size;
+  else if (img.layout.total_size > img.size)
+    abort_printf("%s: variant is too big for its bootsize (%u vs %u bytes)",
+                 img.fname, img.layout.total_size, img.size);
+
+  img.stream = fopen(img.fname, "w");
+  if (!img.stream)
+    abort_perror(img.fname);
+
+  write_bootimg(&img);
+
+  fclose(img.stream);
+  arena_release(&img);
+}
+
+
+void* farm_worker(void* arg)
+{
+  t_farm* f = (t_farm*)arg;
+
+  while (1) {
+    pthread_mutex_lock(&f->lock);
+    int i = f->next++;
+    pthread_mutex_unlock(&f->lock);
+    if (i >= f->num_variants)
+      break;
+
+    farm_write_variant(f->tmpl, &f->variants[i]);
+  }
+
+  return NULL;
+}
+
+
+void run_create_farm(t_abootimg* img)
+{
+  char* list_fname = img->fname;
+
+  if (img->stream_bufsz)
+    abort_printf("%s: the farm shares payloads in memory, -S does not apply\n", list_fname);
+
+  // load the shared payloads once, exactly like a single --create
+  update_header(img);
+  double t0 = prof_begin();
+  update_images(img);
+  prof_end("update_images", t0);
+
+  t_farm f;
+  f.tmpl = img;
+  f.variants = NULL;
+  f.num_variants = 0;
+  f.next = 0;
+  pthread_mutex_init(&f.lock, NULL);
+
+  FILE* list = fopen(list_fname, "r");
+  if (!list)
+    abort_perror(list_fname);
+
+  char* line = NULL;
+  size_t len = 0;
+  int lineno = 0;
+  while (getline(&line, &len, list) != -1) {
+    lineno++;
+    t_variant v;
+    if (!parse_variant_line(line, list_fname, lineno, &v))
+      continue;
+    f.variants = realloc(f.variants, (f.num_variants+1) * sizeof(t_variant));
+    if (!f.variants)
+      abort_perror(NULL);
+    f.variants[f.num_variants++] = v;
+    line = NULL;
+    len = 0;
+  }
+  if (ferror(list))
+    abort_perror(list_fname);
+  fclose(list);
+
+  if (!f.num_variants)
+    abort_printf("%s: no variants to create\n", list_fname);
+
+  int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1)
+    num_workers = 1;
+  if (num_workers > f.num_variants)
+    num_workers = f.num_variants;
+
+  printf("creating %d variants from %s on %d workers\n",
+         f.num_variants, list_fname, num_workers);
+
+  pthread_t workers[num_workers];
+  int i;
+  for (i=0; i<num_workers; i++)
+    if (pthread_create(&workers[i], NULL, farm_worker, &f))
+      abort_perror("pthread_create");
+  for (i=0; i<num_workers; i++)
+    pthread_join(workers[i], NULL);
+}
+
+
+/* daemon mode (--serve): a provisioning station attaches many devices
+ * and used to pay an abootimg start plus open+read+validate of the
+ * same golden image per flash. the daemon listens on a unix socket,
+ * takes one job line per connection (--batch syntax) and forks a
+ * worker whose stdout/stderr stream back over the connection, so
+ * flashes of different devices run concurrently. boot images named in
+ * a job are validated, mapped and faulted in once in the daemon; the
+ * workers inherit the warm mapping and page cache, leaving only the
+ * accept+fork cost per device. */
+
+#define MAX_SERVE_CACHE 8
+
+typedef struct
+{
+  char* fname;
+  FILE* stream;
+  char* map;
+  unsigned size;
+} t_serve_cache;
+
+
+// keep an image warm: validate, map and fault it in once; later
+// requests naming it find every page already resident. non-images
+// (kernel files, flags) are quietly ignored
+void serve_warm(char* fname)
+{
+  static t_serve_cache cache[MAX_SERVE_CACHE];
+  static int ncache = 0;
+  static int next = 0;
+
+  struct stat st;
+  if (stat(fname, &st) || !S_ISREG(st.st_mode)
+      || ((size_t)st.st_size < sizeof(boot_img_hdr)))
+    return;
+
+  int i;
+  for (i = 0; i < ncache; i++)
+    if (!strcmp(cache[i].fname, fname))
+      return;
+
+  FILE* stream = fopen(fname, "r");
+  if (!stream)
+    return;
+
+  boot_img_hdr h;
+  if ((fread(&h, sizeof(h), 1, stream) != 1)
+      || memcmp(h.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+    fclose(stream);
+    return;
+  }
+
+  char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(stream), 0);
+  if (map == MAP_FAILED) {
+    fclose(stream);
+    return;
+  }
+
+  // fault the whole image in now, so the first flash is already warm
+  unsigned sum = 0;
+  unsigned off;
+  for (off = 0; off < st.st_size; off += 4096)
+    sum += map[off];
+  (void)sum;
+
+  // a full cache recycles its oldest slot
+  t_serve_cache* c = (ncache < MAX_SERVE_CACHE) ? &cache[ncache++]
+                                                : &cache[next++ % MAX_SERVE_CACHE];
+  if (c->map) {
+    munmap(c->map, c->size);
+    fclose(c->stream);
+    free(c->fname);
+  }
+  c->fname = strdup(fname);
+  c->stream = stream;
+  c->map = map;
+  c->size = st.st_size;
+
+  printf("serve: warmed %s (%u bytes)\n", fname, c->size);
+}
+
+
+void run_serve(t_abootimg* img)
+{
+  char* spath = img->fname;
+
+  int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sfd == -1)
+    abort_perror(spath);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(spath) >= sizeof(addr.sun_path))
+    abort_printf("%s: socket path too long\n", spath);
+  strcpy(addr.sun_path, spath);
+
+  unlink(spath);  // stale socket from a previous run
+  if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr)))
+    abort_perror(spath);
+  if (listen(sfd, 16))
+    abort_perror(spath);
+
+  // workers are forked and not waited on individually
+  signal(SIGCHLD, SIG_IGN);
+
+  printf("serving on %s\n", spath);
+
+  while (1) {
+    int conn = accept(sfd, NULL, NULL);
+    if (conn == -1) {
+      if (errno == EINTR)
+        continue;
+      abort_perror(spath);
+    }
+
+    // one job line per connection
+    char line[4096];
+    int got = 0;
+    while (got < (int)sizeof(line)-1) {
+      int rb = read(conn, line + got, sizeof(line)-1 - got);
+      if (rb <= 0)
+        break;
+      got += rb;
+      if (memchr(line, '\n', got))
+        break;
+    }
+    line[got] = '\0';
+    char* nl = strchr(line, '\n');
+    if (nl)
+      *nl = '\0';
+
+    if (!strcmp(line, "quit")) {
+      close(conn);
+      break;
+    }
+
+    // warm every image the job names before the worker starts
+    char scan[sizeof(line)];
+    strcpy(scan, line);
+    char* sp = scan;
+    char* tok;
+    while ((tok = strsep(&sp, " \t")))
+      if (*tok)
+        serve_warm(tok);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+      abort_perror(spath);
+    if (pid == 0) {
+      // the worker's output is the response; the inherited mappings
+      // make its reads hit memory, and an abort only ends the worker
+      dup2(conn, 1);
+      dup2(conn, 2);
+      close(conn);
+      close(sfd);
+      run_job(line);
+      exit(0);
+    }
+    close(conn);
+  }
+
+  close(sfd);
+  unlink(spath);
+  printf("serve: done\n");
+}
+
+
+// fill a file with cheap xorshift noise, so the benchmark payloads do
+// not compress or dedup away
+void bench_write_file(char* fname, unsigned size, unsigned seed)
+{
+  FILE* f = fopen(fname, "w");
+  if (!f)
+    abort_perror(fname);
+
+  unsigned bufsz = 1024*1024;
+  uint32_t* buf = malloc(bufsz);
+  if (!buf)
+    abort_perror(NULL);
+
+  uint32_t x = seed * 2654435761u + 1;
+  unsigned left = size;
+  while (left) {
+    unsigned chunk = (left < bufsz) ? left : bufsz;
+    unsigned i;
+    for (i = 0; i < (chunk+3)/4; i++) {
+      x ^= x << 13;  x ^= x >> 17;  x ^= x << 5;
+      buf[i] = x;
+    }
+    fwrite(buf, chunk, 1, f);
+    if (ferror(f))
+      abort_perror(fname);
+    left -= chunk;
+  }
+
+  free(buf);
+  fclose(f);
+}
+
+
+// run one phase with stdout parked on /dev/null so the report stays
+// readable, and report wall time plus the rusage block I/O deltas
+void bench_phase(char* name, char* line)
+{
+  char job[2*PATH_MAX];
+  snprintf(job, sizeof(job), "%s", line);
+
+  fflush(stdout);
+  int saved = dup(1);
+  int devnull = open("/dev/null", O_WRONLY);
+  if ((saved == -1) || (devnull == -1))
+    abort_perror("/dev/null");
+  dup2(devnull, 1);
+  close(devnull);
+
+  struct rusage ru0, ru1;
+  getrusage(RUSAGE_SELF, &ru0);
+  double t0 = prof_now();
+  run_job(job);
+  double t1 = prof_now();
+  getrusage(RUSAGE_SELF, &ru1);
+
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+
+  printf ("   %-8s %9.2f ms   read %8ld KB   written %8ld KB\n",
+          name, t1 - t0,
+          (ru1.ru_inblock - ru0.ru_inblock) / 2,
+          (ru1.ru_oublock - ru0.ru_oublock) / 2);
+}
+
+
+// --bench: synthesize an image in a scratch directory (under $TMPDIR,
+// normally a tmpfs) and time the hot paths, so regressions show up
+// without reaching for external tooling
+void run_bench(t_abootimg* img)
+{
+  unsigned size = img->bench_size;
+  unsigned psize = img->bench_psize;
+  unsigned ndtbs = img->bench_ndtbs;
+
+  char* tmp = getenv("TMPDIR");
+  if (!tmp)
+    tmp = "/tmp";
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/abootimg-bench.%d", tmp, getpid());
+  if (mkdir(dir, 0700))
+    abort_perror(dir);
+  if (chdir(dir))
+    abort_perror(dir);
+
+  printf ("benchmarking in %s: %u MB image, %u byte pages, %u dtbs\n",
+          dir, size >> 20, psize, ndtbs);
+
+  // payloads: kernel 60%, ramdisk 30%, the dtbs share the last 10%.
+  // deliberately not page-aligned, so the padding paths get exercised
+  unsigned ksize = (size/10)*6 - 123;
+  unsigned rsize = (size/10)*3 - 45;
+  bench_write_file("kernel", ksize, 1);
+  bench_write_file("ramdisk", rsize, 2);
+  bench_write_file("ramdisk2", rsize, 3);
+
+  unsigned hdrsz = sizeof(dtbs_t) + ndtbs * sizeof(dt_entry_t);
+  if (hdrsz > psize)
+    abort_printf("--bench: %u dtb entries do not fit one %u byte page", ndtbs, psize);
+
+  char* d = calloc(hdrsz, 1);
+  if (!d)
+    abort_perror(NULL);
+  dtbs_t* dtbh = (dtbs_t*)d;
+  dtbh->magic = 0x48425444; /* "DTBH" */
+  dtbh->version = 2;
+  dtbh->num_entries = ndtbs;
+  dt_entry_t* dt = (dt_entry_t*)(d + sizeof(dtbs_t));
+
+  unsigned dtb_size = (size/10) / ndtbs;
+  if (dtb_size < psize)
+    dtb_size = psize;
+
+  char name[PATH_MAX];
+  unsigned i;
+  for (i = 0; i < ndtbs; i++) {
+    dt[i].chip_id = 0x1000 + i;
+    dt[i].platform_id = 1;
+    dt[i].subtype_id = 1;
+    dt[i].hw_rev = i;
+    dt[i].hw_rev_end = i;
+    snprintf(name, sizeof(name), "platform.dtb_p%u", i);
+    bench_write_file(name, dtb_size, 10 + i);
+  }
+
+  FILE* f = fopen("platform.dtbh", "w");
+  if (!f)
+    abort_perror("platform.dtbh");
+  fwrite(d, hdrsz, 1, f);
+  if (ferror(f))
+    abort_perror("platform.dtbh");
+  fclose(f);
+  free(d);
+
+  char job[2*PATH_MAX];
+  snprintf(job, sizeof(job),
+           "--create boot.img -k kernel -r ramdisk -d platform -c \"pagesize = %u\"",
+           psize);
+  bench_phase("create", job);
+  bench_phase("info", "-i boot.img");
+  bench_phase("extract", "-x boot.img");
+  bench_phase("update", "-u boot.img -r ramdisk2");
+  // second pass with the same payload: the delta writer should find
+  // (almost) nothing to do
+  bench_phase("delta", "-u boot.img --flash-delta -r ramdisk2");
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf ("   peak RSS %ld MB\n", ru.ru_maxrss >> 10);
+
+  unlink("kernel"); unlink("ramdisk"); unlink("ramdisk2");
+  unlink("boot.img"); unlink("boot.img.dtbcache"); unlink("bootimg.cfg"); unlink("zImage");
+  unlink("initrd.gz"); unlink("stage2.img"); unlink("signature");
+  unlink("platform.dtbh");
+  for (i = 0; i < ndtbs; i++) {
+    snprintf(name, sizeof(name), "platform.dtb_p%u", i);
+    unlink(name);
   }
+  if (chdir("/") || rmdir(dir))
+    abort_perror(dir);
+}
+
+
+int main(int argc, char** argv)
+{
+  t_abootimg* bootimg = new_bootimg();
+
+  process_bootimg(parse_args(argc, argv, bootimg), bootimg);
 
   return 0;
 }
@@ -0,0 +1,142 @@
+/* abootimg -  Manipulate (read, modify, create) Android Boot Images
+ *
+ * Plain C SHA-1 with an unrolled block function; fast enough to hash
+ * payloads while they are still warm in the cache, with no dependency
+ * on a crypto library.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "sha1.h"
+
+
+#define ROL(v, b) (((v) << (b)) | ((v) >> (32 - (b))))
+
+static void sha1_block(uint32_t state[5], const unsigned char block[64])
+{
+  uint32_t w[80];
+  uint32_t a, b, c, d, e, t;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16)
+         | ((uint32_t)block[i*4+2] << 8) | (uint32_t)block[i*4+3];
+  for (i = 16; i < 80; i++)
+    w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+
+#define R(f, k, i) \
+  t = ROL(a, 5) + (f) + e + (k) + w[i]; \
+  e = d; d = c; c = ROL(b, 30); b = a; a = t;
+
+  for (i = 0; i < 20; i++)  { R((b & c) | (~b & d),        0x5a827999, i) }
+  for (i = 20; i < 40; i++) { R(b ^ c ^ d,                 0x6ed9eba1, i) }
+  for (i = 40; i < 60; i++) { R((b & c) | (b & d) | (c & d), 0x8f1bbcdc, i) }
+  for (i = 60; i < 80; i++) { R(b ^ c ^ d,                 0xca62c1d6, i) }
+
+#undef R
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+
+void sha1_init(sha1_ctx* ctx)
+{
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xc3d2e1f0;
+  ctx->count = 0;
+}
+
+
+void sha1_update(sha1_ctx* ctx, const void* data, unsigned len)
+{
+  const unsigned char* p = data;
+  unsigned fill = ctx->count % 64;
+
+  ctx->count += len;
+
+  if (fill) {
+    unsigned n = 64 - fill;
+    if (len < n) {
+      memcpy(ctx->buffer + fill, p, len);
+      return;
+    }
+    memcpy(ctx->buffer + fill, p, n);
+    sha1_block(ctx->state, ctx->buffer);
+    p += n;
+    len -= n;
+  }
+
+  while (len >= 64) {
+    sha1_block(ctx->state, p);
+    p += 64;
+    len -= 64;
+  }
+
+  if (len)
+    memcpy(ctx->buffer, p, len);
+}
+
+
+void sha1_final(sha1_ctx* ctx, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+  uint64_t bits = ctx->count * 8;
+  unsigned char pad = 0x80;
+  unsigned char lenb[8];
+  int i;
+
+  for (i = 0; i < 8; i++)
+    lenb[i] = (bits >> (56 - i*8)) & 0xff;
+
+  sha1_update(ctx, &pad, 1);
+  pad = 0;
+  while (ctx->count % 64 != 56)
+    sha1_update(ctx, &pad, 1);
+  sha1_update(ctx, lenb, 8);
+
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    digest[i] = (ctx->state[i/4] >> (24 - (i%4)*8)) & 0xff;
+}
+
+
+void hmac_sha1(const void* key, unsigned klen, const void* data, unsigned dlen,
+               unsigned char out[SHA1_DIGEST_SIZE])
+{
+  unsigned char kbuf[64];
+  unsigned char pad[64];
+  unsigned char inner[SHA1_DIGEST_SIZE];
+  sha1_ctx ctx;
+  unsigned i;
+
+  memset(kbuf, 0, sizeof(kbuf));
+  if (klen > sizeof(kbuf)) {
+    sha1_init(&ctx);
+    sha1_update(&ctx, key, klen);
+    sha1_final(&ctx, kbuf);
+  }
+  else
+    memcpy(kbuf, key, klen);
+
+  for (i = 0; i < sizeof(pad); i++)
+    pad[i] = kbuf[i] ^ 0x36;
+  sha1_init(&ctx);
+  sha1_update(&ctx, pad, sizeof(pad));
+  sha1_update(&ctx, data, dlen);
+  sha1_final(&ctx, inner);
+
+  for (i = 0; i < sizeof(pad); i++)
+    pad[i] = kbuf[i] ^ 0x5c;
+  sha1_init(&ctx);
+  sha1_update(&ctx, pad, sizeof(pad));
+  sha1_update(&ctx, inner, sizeof(inner));
+  sha1_final(&ctx, out);
+}
@@ -0,0 +1,32 @@
+/* abootimg -  Manipulate (read, modify, create) Android Boot Images
+ *
+ * SHA-1, used to fill the boot_img_hdr id[] field the way mkbootimg
+ * does (hash of kernel/ramdisk/second and their sizes).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE 20
+
+typedef struct {
+  uint32_t      state[5];
+  uint64_t      count;                /* bytes processed so far */
+  unsigned char buffer[64];
+} sha1_ctx;
+
+void sha1_init(sha1_ctx* ctx);
+void sha1_update(sha1_ctx* ctx, const void* data, unsigned len);
+void sha1_final(sha1_ctx* ctx, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+void hmac_sha1(const void* key, unsigned klen, const void* data, unsigned dlen,
+               unsigned char out[SHA1_DIGEST_SIZE]);
+
+#endif